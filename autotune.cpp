@@ -0,0 +1,282 @@
+/*
+ * autotune.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Autotuning. Each setting is tuned on the stage it affects: CLIP encode for CLIP threads, image
+ * embedding prefill (the bulk of a request's prompt) for batch threads and batch size, and
+ * single-token generation for generation threads. A llama context is created per thread count,
+ * because thread counts are fixed when a context is created. Each measurement is the median of
+ * several repetitions after an untimed one.
+ *
+ * Profile lines have the form "<key>\t<n_threads> <n_threads_batch> <n_batch> <n_threads_clip>".
+ */
+
+#include "autotune.hpp"
+#include "llava_eval.hpp"
+#include "llava_image.hpp"
+
+#include "llama.cpp/examples/llava/clip.h"
+#include "llama.cpp/llama.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <vector>
+
+static constexpr int k_repetitions = 3;
+static constexpr int k_generated_tokens = 16;
+static const int k_batch_sizes[] = { 64, 128, 256, 512 };
+
+static std::string cpu_model_name()
+{
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line))
+    {
+        if (line.compare(0, 10, "model name") == 0)
+        {
+            const size_t colon = line.find(':');
+            return colon == std::string::npos ? "" : line.substr(colon + 2);
+        }
+    }
+    return "unknown";
+}
+
+static std::string file_name_and_size(const std::string &path)
+{
+    struct stat st;
+    const size_t slash = path.find_last_of('/');
+    const std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    return name + ":" + std::to_string(stat(path.c_str(), &st) == 0 ? (long long) st.st_size : 0ll);
+}
+
+std::string autotune_key(const gpt_params &params, const std::string &mmproj_quant, int available_cpus)
+{
+    std::string key = cpu_model_name() + "|cpus=" + std::to_string(available_cpus) + "|" + file_name_and_size(params.model) + "|" + file_name_and_size(params.mmproj);
+    if (!mmproj_quant.empty())
+    {
+        key += "|mmproj_quant=" + mmproj_quant;
+    }
+    std::replace(key.begin(), key.end(), '\t', ' ');
+    return key;
+}
+
+// Median duration in ms of run() over k_repetitions, after one untimed repetition. reset() is
+// called before each repetition.
+static double median_ms(const std::function<void()> &run, const std::function<void()> &reset)
+{
+    std::vector<double> samples;
+    for (int rep = 0; rep <= k_repetitions; rep++)
+    {
+        reset();
+        const int64_t t_start_us = ggml_time_us();
+        run();
+        const int64_t t_end_us = ggml_time_us();
+        if (rep > 0)
+        {
+            samples.push_back((t_end_us - t_start_us) / 1000.0);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+    return samples[samples.size() / 2];
+}
+
+// Powers of two up to available_cpus, plus available_cpus itself and three quarters of it
+static std::vector<int> thread_candidates(int available_cpus)
+{
+    std::vector<int> candidates = { available_cpus, std::max(1, available_cpus * 3 / 4) };
+    for (int n = 1; n < available_cpus; n *= 2)
+    {
+        candidates.push_back(n);
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+    return candidates;
+}
+
+bool autotune(const gpt_params &params, int available_cpus, tuned_settings &best)
+{
+    const int64_t t_start_us = ggml_time_us();
+    const std::vector<int> thread_counts = thread_candidates(available_cpus);
+
+    clip_ctx *ctx_clip = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 0);
+    if (!ctx_clip)
+    {
+        fprintf(stderr, "%s: error: unable to load CLIP model\n", __func__);
+        return false;
+    }
+
+    llama_backend_init(params.numa);
+    llama_model *model = llama_load_model_from_file(params.model.c_str(), llama_model_default_params());
+    if (!model)
+    {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        clip_free(ctx_clip);
+        return false;
+    }
+
+    // Synthetic image, as used for warmup
+    std::vector<uint8_t> bmp = make_synthetic_bmp(336, 336);
+    clip_image_u8 img = {};
+    clip_image_f32 img_res = {};
+    if (!clip_image_load_from_memory(bmp.data(), bmp.size(), &img) || !clip_image_preprocess(ctx_clip, &img, &img_res, /*pad2square =*/ true))
+    {
+        fprintf(stderr, "%s: error: unable to preprocess synthetic image\n", __func__);
+        llama_free_model(model);
+        clip_free(ctx_clip);
+        return false;
+    }
+    free_image_data(&img);
+
+    const int n_img_pos = clip_n_patches(ctx_clip);
+    std::vector<float> image_embd(clip_embd_nbytes(ctx_clip) / sizeof(float));
+
+    printf("%s: CLIP encode\n", __func__);
+    double best_ms = 0;
+    for (int n_threads : thread_counts)
+    {
+        const double ms = median_ms([&]() { clip_image_encode(ctx_clip, n_threads, &img_res, image_embd.data()); }, []() {});
+        printf("%s:   n_threads = %3d: %10.2f ms\n", __func__, n_threads, ms);
+        if (best.n_threads_clip == 0 || ms < best_ms)
+        {
+            best.n_threads_clip = n_threads;
+            best_ms = ms;
+        }
+    }
+    free_image_data(&img_res);
+
+    printf("%s: image embedding prefill (%d tokens) and generation (%d tokens)\n", __func__, n_img_pos, k_generated_tokens);
+    double best_prefill_ms = 0;
+    double best_token_ms = 0;
+    gpt_params sampling_params = params;
+    for (int n_threads : thread_counts)
+    {
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx           = params.n_ctx < 2048 ? 2048 : params.n_ctx;
+        ctx_params.n_batch         = uint32_t(*std::max_element(std::begin(k_batch_sizes), std::end(k_batch_sizes)));
+        ctx_params.f16_kv          = params.memory_f16;
+        ctx_params.n_threads       = n_threads;
+        ctx_params.n_threads_batch = n_threads;
+        llama_context *ctx_llama = llama_new_context_with_model(model, ctx_params);
+        if (!ctx_llama)
+        {
+            fprintf(stderr, "%s: error: failed to create the llama_context\n", __func__);
+            continue;
+        }
+
+        int n_past = 0;
+        auto clear = [&]() { llama_kv_cache_tokens_rm(ctx_llama, -1, -1); n_past = 0; };
+        for (int n_batch : k_batch_sizes)
+        {
+            const double ms = median_ms([&]() { llava_eval_image_embd(ctx_llama, image_embd.data(), n_img_pos, n_batch, &n_past); }, clear);
+            printf("%s:   n_threads_batch = %3d, n_batch = %3d: %10.2f ms prefill\n", __func__, n_threads, n_batch, ms);
+            if (best.n_threads_batch == 0 || ms < best_prefill_ms)
+            {
+                best.n_threads_batch = n_threads;
+                best.n_batch = n_batch;
+                best_prefill_ms = ms;
+            }
+        }
+
+        // Generation follows a prefilled image, as it does in a real request
+        auto prefill = [&]()
+        {
+            clear();
+            llava_eval_image_embd(ctx_llama, image_embd.data(), n_img_pos, ctx_params.n_batch, &n_past);
+        };
+        const double ms = median_ms([&]()
+        {
+            for (int i = 0; i < k_generated_tokens; i++)
+            {
+                llava_sample(ctx_llama, sampling_params, &n_past);
+            }
+        }, prefill) / k_generated_tokens;
+        printf("%s:   n_threads = %3d: %10.2f ms per token\n", __func__, n_threads, ms);
+        if (best.n_threads == 0 || ms < best_token_ms)
+        {
+            best.n_threads = n_threads;
+            best_token_ms = ms;
+        }
+
+        llama_free(ctx_llama);
+    }
+
+    llama_free_model(model);
+    clip_free(ctx_clip);
+
+    if (best.n_threads == 0 || best.n_threads_batch == 0)
+    {
+        fprintf(stderr, "%s: error: no configuration could be measured\n", __func__);
+        return false;
+    }
+    printf("%s: best: n_threads = %d, n_threads_batch = %d, n_batch = %d, n_threads_clip = %d (tuned in %.1f s)\n", __func__,
+        best.n_threads, best.n_threads_batch, best.n_batch, best.n_threads_clip, (ggml_time_us() - t_start_us) / 1e6);
+    return true;
+}
+
+static bool parse_profile_line(const std::string &line, std::string &key, tuned_settings &settings)
+{
+    const size_t tab = line.find('\t');
+    if (tab == std::string::npos)
+    {
+        return false;
+    }
+    key = line.substr(0, tab);
+    std::istringstream values(line.substr(tab + 1));
+    return bool(values >> settings.n_threads >> settings.n_threads_batch >> settings.n_batch >> settings.n_threads_clip) &&
+           settings.n_threads > 0 && settings.n_threads_batch > 0 && settings.n_batch > 0 && settings.n_threads_clip > 0;
+}
+
+bool autotune_load_profile(const std::string &path, const std::string &key, tuned_settings &settings)
+{
+    std::ifstream file(path);
+    std::string line;
+    while (std::getline(file, line))
+    {
+        std::string line_key;
+        tuned_settings line_settings;
+        if (parse_profile_line(line, line_key, line_settings) && line_key == key)
+        {
+            settings = line_settings;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool autotune_save_profile(const std::string &path, const std::string &key, const tuned_settings &settings)
+{
+    // Keep entries for other keys
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(path);
+        std::string line;
+        while (std::getline(file, line))
+        {
+            std::string line_key;
+            tuned_settings line_settings;
+            if (parse_profile_line(line, line_key, line_settings) && line_key != key)
+            {
+                lines.emplace_back(line);
+            }
+        }
+    }
+    lines.emplace_back(key + "\t" + std::to_string(settings.n_threads) + " " + std::to_string(settings.n_threads_batch) + " " +
+        std::to_string(settings.n_batch) + " " + std::to_string(settings.n_threads_clip));
+
+    std::ofstream file(path, std::ios::trunc);
+    for (const std::string &line : lines)
+    {
+        file << line << std::endl;
+    }
+    if (!file)
+    {
+        fprintf(stderr, "%s: error: unable to write %s\n", __func__, path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,40 @@
+/*
+ * autotune.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Startup autotuning of thread counts and batch size. The best settings depend on the CPU, the
+ * model's quantization, and cache sizes, so they are measured on the host with a synthetic
+ * workload and saved to a profile file, keyed by what they were measured for, for later starts
+ * to reuse.
+ */
+
+#pragma once
+#ifndef INCLUDED_AUTOTUNE_HPP
+#define INCLUDED_AUTOTUNE_HPP
+
+#include "llama.cpp/common/common.h"
+
+#include <string>
+
+struct tuned_settings
+{
+    int n_threads = 0;          // token generation
+    int n_threads_batch = 0;    // prompt prefill
+    int n_batch = 0;
+    int n_threads_clip = 0;
+};
+
+// Identifies the CPU model, number of available CPUs, and the model and mmproj files (by name and
+// size, which reflect quantization), along with the type the mmproj is quantized to when loaded
+// (empty if it is not)
+std::string autotune_key(const gpt_params &params, const std::string &mmproj_quant, int available_cpus);
+
+// Benchmarks CLIP encode, image embedding prefill, and generation across thread counts up to
+// available_cpus and several batch sizes, loading params.model and params.mmproj for the purpose
+bool autotune(const gpt_params &params, int available_cpus, tuned_settings &best);
+
+// A profile holds one line per key, so that one file can serve several host types and models
+bool autotune_load_profile(const std::string &path, const std::string &key, tuned_settings &settings);
+bool autotune_save_profile(const std::string &path, const std::string &key, const tuned_settings &settings);
+
+#endif  // INCLUDED_AUTOTUNE_HPP
@@ -0,0 +1,54 @@
+/*
+ * backend_slot.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Holds the backend that new requests are sent to. A lease is a shared_ptr with a control block
+ * of its own, holding a reference to the slot's backend that its deleter drops. The owner's
+ * reference count therefore changes only under s_release_mtx once a backend has left its slot,
+ * and each change is signaled to free_when_released().
+ */
+
+#include "backend_slot.hpp"
+
+#include <condition_variable>
+
+static std::mutex s_release_mtx;
+static std::condition_variable s_release_cv;
+
+std::shared_ptr<active_backend> backend_slot::current() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    if (!m_current)
+    {
+        return nullptr;
+    }
+    return std::shared_ptr<active_backend>(m_current.get(), [owner = m_current](active_backend *) mutable
+    {
+        // If this is the last reference, free the backend after letting go of the lock
+        std::shared_ptr<active_backend> last;
+        {
+            std::lock_guard<std::mutex> lock(s_release_mtx);
+            if (owner.use_count() == 1)
+            {
+                last = std::move(owner);
+            }
+            owner.reset();
+        }
+        s_release_cv.notify_all();
+    });
+}
+
+std::shared_ptr<active_backend> backend_slot::replace(std::shared_ptr<active_backend> backend)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::swap(m_current, backend);
+    return backend;
+}
+
+void backend_slot::free_when_released(std::shared_ptr<active_backend> backend)
+{
+    std::unique_lock<std::mutex> lock(s_release_mtx);
+    s_release_cv.wait(lock, [&backend]() { return backend.use_count() <= 1; });
+    lock.unlock();
+    backend.reset();
+}
@@ -0,0 +1,46 @@
+/*
+ * backend_slot.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Holds the backend that new requests are sent to. Requests keep a reference to the backend they
+ * started on, so a replacement can be published at any time: requests already in flight or
+ * queued finish on the old backend, which is freed once the last of them lets go of it.
+ *
+ * The slot owns its backend, and current() hands out leases on it. Whoever replaces a backend
+ * receives its ownership back and can wait in free_when_released() for the leases to be let go
+ * of, so that the backend is freed on that thread rather than on a request thread.
+ */
+
+#pragma once
+#ifndef INCLUDED_BACKEND_SLOT_HPP
+#define INCLUDED_BACKEND_SLOT_HPP
+
+#include "inference_backend.hpp"
+
+#include <memory>
+#include <mutex>
+
+struct active_backend
+{
+    std::unique_ptr<inference_backend> backend;
+    std::mutex mtx;             // serializes inference on this backend
+};
+
+class backend_slot
+{
+public:
+    // Returns a lease on the current backend, or nullptr if none has been published yet
+    std::shared_ptr<active_backend> current() const;
+
+    // Publishes a new backend, which must not be referenced elsewhere, returning the previous one
+    std::shared_ptr<active_backend> replace(std::shared_ptr<active_backend> backend);
+
+    // Waits until every lease on a backend returned by replace() has been let go of, then frees it
+    static void free_when_released(std::shared_ptr<active_backend> backend);
+
+private:
+    mutable std::mutex m_mtx;
+    std::shared_ptr<active_backend> m_current;
+};
+
+#endif  // INCLUDED_BACKEND_SLOT_HPP
@@ -0,0 +1,311 @@
+/*
+ * capture.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Traffic capture. Captured requests are appended to <directory>/corpus.jsonl in the format
+ * llava-bench replays, along with the timings observed when they were served:
+ *
+ *      {"image": "images/<hash>.jpg", "user_prompt": "...", "system_prompt": "...", "params": {...},
+ *       "observed": {"status": 200, "error": false, "e2e_ms": 812.4, "timings_ms": {"queue": 0.1, ...}}}
+ *
+ * Images are named by a 64-bit FNV-1a hash of their contents, so repeated images are stored once.
+ *
+ * Requests are only copied on the request path. A writer thread hashes the images and writes the
+ * files, so that slow storage never delays responses. If the writer falls more than
+ * k_max_queued_bytes behind, further requests are dropped from the capture.
+ */
+
+#include "capture.hpp"
+#include "web_server.hpp"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <thread>
+#include <sys/stat.h>
+
+static constexpr size_t k_max_queued_bytes = 64 * 1024 * 1024;
+
+// A captured request, with the corpus line minus its image path, which the writer fills in
+struct capture_record
+{
+    std::unique_ptr<uint8_t[]> image;
+    size_t image_size = 0;
+    std::string fields;
+};
+
+static std::atomic<bool> s_enabled(false);
+static double s_sample_rate = 1.0;
+static std::string s_directory;
+static FILE *s_corpus_fp = nullptr;
+static std::set<std::string> s_stored_images;     // accessed only by the writer thread
+
+static std::mutex s_queue_mutex;
+static std::condition_variable s_queue_cv;
+static std::deque<capture_record> s_queue;
+static size_t s_queued_bytes = 0;
+static size_t s_pending = 0;        // records counted in s_queued_bytes that are still being copied
+static bool s_stop = false;
+static size_t s_dropped = 0;
+static std::thread s_writer_thread;
+static std::mutex s_close_mutex;   // serializes closing by main and the shutdown watchdog
+
+static bool make_directory(const std::string &path)
+{
+    if (mkdir(path.c_str(), 0755) == 0)
+    {
+        return true;
+    }
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+static bool file_exists(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static std::string content_hash(const uint8_t *data, size_t size)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= data[i];
+        hash *= 0x100000001b3ull;
+    }
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long) hash);
+    return buf;
+}
+
+static const char *image_extension(const uint8_t *data, size_t size)
+{
+    if (size >= 3 && data[0] == 0xff && data[1] == 0xd8 && data[2] == 0xff)
+    {
+        return ".jpg";
+    }
+    if (size >= 8 && !memcmp(data, "\x89PNG\r\n\x1a\n", 8))
+    {
+        return ".png";
+    }
+    if (size >= 6 && (!memcmp(data, "GIF87a", 6) || !memcmp(data, "GIF89a", 6)))
+    {
+        return ".gif";
+    }
+    if (size >= 2 && data[0] == 'B' && data[1] == 'M')
+    {
+        return ".bmp";
+    }
+    return ".bin";
+}
+
+// Converts a Server-Timing header value (name;dur=ms, ...) into a JSON object of durations
+static std::string server_timing_to_json(const std::string &server_timing)
+{
+    std::string json = "{";
+    size_t pos = 0;
+    while (pos < server_timing.size())
+    {
+        size_t end = server_timing.find(',', pos);
+        if (end == std::string::npos)
+        {
+            end = server_timing.size();
+        }
+        std::string metric = server_timing.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t name_start = metric.find_first_not_of(' ');
+        size_t semicolon = metric.find(';');
+        size_t dur = metric.find("dur=");
+        if (name_start == std::string::npos || semicolon == std::string::npos || dur == std::string::npos)
+        {
+            continue;
+        }
+        if (json.size() > 1)
+        {
+            json += ", ";
+        }
+        json += "\"" + escape_json(metric.substr(name_start, semicolon - name_start)) + "\": " + std::to_string(atof(metric.c_str() + dur + 4));
+    }
+    return json + "}";
+}
+
+static void write_record(const capture_record &record)
+{
+    const uint8_t *image = record.image.get();
+    const std::string image_path = "images/" + content_hash(image, record.image_size) + image_extension(image, record.image_size);
+
+    if (s_stored_images.count(image_path) == 0)
+    {
+        const std::string full_path = s_directory + "/" + image_path;
+        if (!file_exists(full_path))
+        {
+            FILE *fp = fopen(full_path.c_str(), "wb");
+            if (!fp || fwrite(image, 1, record.image_size, fp) != record.image_size)
+            {
+                fprintf(stderr, "%s: error: unable to write %s\n", __func__, full_path.c_str());
+                if (fp)
+                {
+                    fclose(fp);
+                }
+                return;
+            }
+            fclose(fp);
+        }
+        s_stored_images.insert(image_path);
+    }
+
+    fputs(("{\"image\": \"" + image_path + "\", " + record.fields).c_str(), s_corpus_fp);
+    fflush(s_corpus_fp);
+}
+
+static void writer_thread()
+{
+    std::unique_lock<std::mutex> lock(s_queue_mutex);
+    while (true)
+    {
+        // Records admitted before capture_close() are still written
+        s_queue_cv.wait(lock, []() { return (s_stop && s_pending == 0) || !s_queue.empty(); });
+        if (s_queue.empty())
+        {
+            return;
+        }
+        capture_record record = std::move(s_queue.front());
+        s_queue.pop_front();
+        lock.unlock();
+        write_record(record);
+        lock.lock();
+        s_queued_bytes -= record.image_size + record.fields.size();
+    }
+}
+
+bool capture_open(const std::string &directory, double sample_rate)
+{
+    if (!make_directory(directory) || !make_directory(directory + "/images"))
+    {
+        fprintf(stderr, "%s: error: unable to create capture directory %s\n", __func__, directory.c_str());
+        return false;
+    }
+
+    std::string corpus_file = directory + "/corpus.jsonl";
+    s_corpus_fp = fopen(corpus_file.c_str(), "a");
+    if (!s_corpus_fp)
+    {
+        fprintf(stderr, "%s: error: unable to open %s\n", __func__, corpus_file.c_str());
+        return false;
+    }
+
+    s_directory = directory;
+    s_sample_rate = sample_rate;
+    s_stop = false;
+    s_enabled = true;
+    s_writer_thread = std::thread(writer_thread);
+    printf("%s: capturing %.1f%% of requests to %s\n", __func__, sample_rate * 100.0, corpus_file.c_str());
+    return true;
+}
+
+bool capture_enabled()
+{
+    return s_enabled.load(std::memory_order_relaxed);
+}
+
+bool capture_sample()
+{
+    if (!capture_enabled())
+    {
+        return false;
+    }
+    if (s_sample_rate >= 1.0)
+    {
+        return true;
+    }
+    thread_local std::mt19937 rng(std::random_device{}());
+    return std::uniform_real_distribution<double>(0.0, 1.0)(rng) < s_sample_rate;
+}
+
+void capture_request(
+    const llava_request &request,
+    const std::vector<std::pair<std::string, std::string>> &params,
+    int status,
+    bool error,
+    const std::string &server_timing,
+    double e2e_ms
+)
+{
+    std::string params_json = "{";
+    for (auto &param : params)
+    {
+        params_json += std::string(params_json.size() > 1 ? ", " : "") + "\"" + escape_json(param.first) + "\": \"" + escape_json(param.second) + "\"";
+    }
+    params_json += "}";
+
+    char observed[128];
+    snprintf(observed, sizeof(observed), "{\"status\": %d, \"error\": %s, \"e2e_ms\": %.3f, \"timings_ms\": ", status, error ? "true" : "false", e2e_ms);
+
+    capture_record record;
+    record.fields =
+        "\"user_prompt\": \"" + escape_json(request.user_prompt) + "\", "
+        "\"system_prompt\": \"" + escape_json(request.system_prompt) + "\", "
+        "\"params\": " + params_json + ", "
+        "\"observed\": " + observed + server_timing_to_json(server_timing) + "}}\n";
+    record.image_size = request.image_buffer_size;
+
+    const size_t bytes = record.image_size + record.fields.size();
+    {
+        std::lock_guard<std::mutex> lock(s_queue_mutex);
+        if (s_stop)
+        {
+            return;
+        }
+        if (s_queued_bytes + bytes > k_max_queued_bytes)
+        {
+            if (s_dropped++ == 0)
+            {
+                fprintf(stderr, "%s: warning: capture is falling behind, dropping requests\n", __func__);
+            }
+            return;
+        }
+        s_queued_bytes += bytes;
+        s_pending++;
+    }
+
+    record.image = std::make_unique<uint8_t[]>(record.image_size);
+    memcpy(record.image.get(), request.image.get(), record.image_size);
+    {
+        std::lock_guard<std::mutex> lock(s_queue_mutex);
+        s_pending--;
+        s_queue.emplace_back(std::move(record));
+    }
+    s_queue_cv.notify_one();
+}
+
+void capture_close()
+{
+    std::lock_guard<std::mutex> close_lock(s_close_mutex);
+    if (!s_enabled)
+    {
+        return;
+    }
+
+    s_enabled = false;
+    {
+        std::lock_guard<std::mutex> lock(s_queue_mutex);
+        s_stop = true;
+    }
+    s_queue_cv.notify_one();
+    s_writer_thread.join();
+
+    if (s_dropped > 0)
+    {
+        fprintf(stderr, "%s: %zu requests were not captured because capture fell behind\n", __func__, s_dropped);
+    }
+    fclose(s_corpus_fp);
+    s_corpus_fp = nullptr;
+}
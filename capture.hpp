@@ -0,0 +1,41 @@
+/*
+ * capture.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Traffic capture. Samples /llava requests and writes them to a replay corpus that llava-bench
+ * can consume directly.
+ */
+
+#pragma once
+#ifndef INCLUDED_CAPTURE_HPP
+#define INCLUDED_CAPTURE_HPP
+
+#include "llava_request.hpp"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+bool capture_open(const std::string &directory, double sample_rate);
+bool capture_enabled();
+
+// Writes the requests still queued and closes the corpus. Safe to call more than once and from
+// several threads; later calls wait for the first to finish.
+void capture_close();
+
+// Decides whether the next request should be captured
+bool capture_sample();
+
+// Queues a request to be appended to <directory>/corpus.jsonl. The image is stored once per
+// distinct content hash under <directory>/images/. Extra form fields are recorded as params.
+// Requests queued once capture_close() has begun are ignored; those queued before are written.
+void capture_request(
+    const llava_request &request,
+    const std::vector<std::pair<std::string, std::string>> &params,
+    int status,
+    bool error,
+    const std::string &server_timing,
+    double e2e_ms
+);
+
+#endif  // INCLUDED_CAPTURE_HPP
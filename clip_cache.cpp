@@ -0,0 +1,71 @@
+/*
+ * clip_cache.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Shared CLIP contexts. Files are identified by device, inode, size, and modification time, so a
+ * file that is replaced in place (e.g., before a hot reload) is loaded afresh rather than
+ * matched to the context of its predecessor.
+ */
+
+#include "clip_cache.hpp"
+#include "memory_accounting.hpp"
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <map>
+#include <tuple>
+
+typedef std::tuple<uint64_t, uint64_t, int64_t, int64_t, int> file_identity;    // dev, inode, size, mtime, NUMA node
+
+static std::mutex s_mtx;
+static std::map<file_identity, std::weak_ptr<shared_clip_ctx>> s_contexts;
+
+shared_clip_ctx::~shared_clip_ctx()
+{
+    if (ctx)
+    {
+        clip_free(ctx);
+    }
+    memory_add_allocated(memory_component::clip, -bytes);
+}
+
+std::shared_ptr<shared_clip_ctx> clip_cache_load(const std::string &mmproj_path, int numa_node)
+{
+    struct stat st;
+    if (stat(mmproj_path.c_str(), &st) != 0)
+    {
+        fprintf(stderr, "%s: error: unable to open %s\n", __func__, mmproj_path.c_str());
+        return nullptr;
+    }
+    const file_identity identity(uint64_t(st.st_dev), uint64_t(st.st_ino), int64_t(st.st_size), int64_t(st.st_mtime), numa_node);
+
+    // Loads happen under the lock so that concurrent requests for the same file load it once
+    std::lock_guard<std::mutex> lock(s_mtx);
+    std::shared_ptr<shared_clip_ctx> shared = s_contexts[identity].lock();
+    if (shared)
+    {
+        return shared;
+    }
+
+    shared = std::make_shared<shared_clip_ctx>();
+    shared->ctx = clip_model_load(mmproj_path.c_str(), /*verbosity=*/ 1);
+    if (!shared->ctx)
+    {
+        s_contexts.erase(identity);
+        return nullptr;
+    }
+
+    // CLIP weights are read into memory in full. Its compute buffers are not visible through the
+    // CLIP API and are not included.
+    shared->bytes = int64_t(st.st_size);
+    memory_add_allocated(memory_component::clip, shared->bytes);
+
+    // Drop entries whose contexts have been freed
+    for (auto it = s_contexts.begin(); it != s_contexts.end(); )
+    {
+        it = it->second.expired() ? s_contexts.erase(it) : std::next(it);
+    }
+    s_contexts[identity] = shared;
+    return shared;
+}
@@ -0,0 +1,34 @@
+/*
+ * clip_cache.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Shares CLIP contexts between backends that use the same mmproj file. A context is loaded the
+ * first time its file is requested and freed when the last backend using it is destroyed.
+ */
+
+#pragma once
+#ifndef INCLUDED_CLIP_CACHE_HPP
+#define INCLUDED_CLIP_CACHE_HPP
+
+#include "llama.cpp/examples/llava/clip.h"
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct shared_clip_ctx
+{
+    clip_ctx *ctx = nullptr;
+    std::mutex encode_mtx;      // CLIP compute buffers are per context, so encodes must be serialized
+    int64_t bytes = 0;          // accounted in memory_component::clip
+
+    ~shared_clip_ctx();
+};
+
+// Returns the CLIP context for an mmproj file, loading it if no backend is using it yet. Returns
+// nullptr if it cannot be loaded. Contexts loaded for a NUMA node (other than -1) are only shared
+// with backends on the same node.
+std::shared_ptr<shared_clip_ctx> clip_cache_load(const std::string &mmproj_path, int numa_node = -1);
+
+#endif  // INCLUDED_CLIP_CACHE_HPP
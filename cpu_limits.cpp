@@ -0,0 +1,143 @@
+/*
+ * cpu_limits.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * CPU limits. The process's cgroup is looked up in /proc/self/cgroup and its quota is read from
+ * under /sys/fs/cgroup, falling back to the root of the hierarchy, which is what a container
+ * with its own cgroup namespace sees. Linux only; elsewhere, all online CPUs are available.
+ */
+
+#include "cpu_limits.hpp"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <thread>
+
+// Reads "<quota> <period>" (cgroup v2 cpu.max), where the quota may be "max"
+static bool read_cpu_max(const std::string &path, double &quota_cpus)
+{
+    std::ifstream file(path);
+    std::string quota;
+    double period = 0;
+    if (!(file >> quota >> period))
+    {
+        return false;
+    }
+    quota_cpus = quota == "max" || period <= 0 ? 0 : std::stod(quota) / period;
+    return true;
+}
+
+// Reads cpu.cfs_quota_us and cpu.cfs_period_us (cgroup v1), where a quota of -1 is unlimited
+static bool read_cfs_quota(const std::string &dir, double &quota_cpus)
+{
+    std::ifstream quota_file(dir + "/cpu.cfs_quota_us");
+    std::ifstream period_file(dir + "/cpu.cfs_period_us");
+    double quota = 0, period = 0;
+    if (!(quota_file >> quota) || !(period_file >> period))
+    {
+        return false;
+    }
+    quota_cpus = quota <= 0 || period <= 0 ? 0 : quota / period;
+    return true;
+}
+
+static double read_quota_cpus()
+{
+    // Lines are "<id>:<controllers>:<path>". cgroup v2 has a single line with id 0 and no
+    // controllers; v1 has a line per hierarchy, of which we want the one with the cpu controller.
+    std::string v2_path, v1_path;
+    std::ifstream cgroup("/proc/self/cgroup");
+    std::string line;
+    while (std::getline(cgroup, line))
+    {
+        const size_t colon1 = line.find(':');
+        const size_t colon2 = colon1 == std::string::npos ? std::string::npos : line.find(':', colon1 + 1);
+        if (colon2 == std::string::npos)
+        {
+            continue;
+        }
+        const std::string controllers = "," + line.substr(colon1 + 1, colon2 - colon1 - 1) + ",";
+        const std::string path = line.substr(colon2 + 1);
+        if (line.compare(0, colon1, "0") == 0 && controllers == ",,")
+        {
+            v2_path = path;
+        }
+        else if (controllers.find(",cpu,") != std::string::npos)
+        {
+            v1_path = path;
+        }
+    }
+
+    double quota_cpus = 0;
+    if (!v1_path.empty())
+    {
+        for (const char *root : { "/sys/fs/cgroup/cpu", "/sys/fs/cgroup/cpu,cpuacct" })
+        {
+            if (read_cfs_quota(root + v1_path, quota_cpus) || read_cfs_quota(root, quota_cpus))
+            {
+                return quota_cpus;
+            }
+        }
+    }
+    if (read_cpu_max("/sys/fs/cgroup" + v2_path + "/cpu.max", quota_cpus) || read_cpu_max("/sys/fs/cgroup/cpu.max", quota_cpus))
+    {
+        return quota_cpus;
+    }
+    return 0;
+}
+
+int cpu_limits::available() const
+{
+    int cpus = affinity_cpus > 0 ? affinity_cpus : online_cpus;
+    if (quota_cpus > 0)
+    {
+        cpus = std::min(cpus, int(std::ceil(quota_cpus)));
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+int cpu_limits::available_on(int cpus) const
+{
+    const int total = affinity_cpus > 0 ? affinity_cpus : online_cpus;
+    if (quota_cpus > 0 && total > 0)
+    {
+        cpus = std::min(cpus, int(std::ceil(quota_cpus * cpus / total)));
+    }
+    return cpus > 0 ? cpus : 1;
+}
+
+std::string cpu_limits::description() const
+{
+    char buf[256];
+    if (quota_cpus > 0)
+    {
+        snprintf(buf, sizeof(buf), "%d available (%d online, %d in affinity mask, cgroup quota %.2f CPUs)", available(), online_cpus, affinity_cpus, quota_cpus);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%d available (%d online, %d in affinity mask, no cgroup quota)", available(), online_cpus, affinity_cpus);
+    }
+    return buf;
+}
+
+cpu_limits read_cpu_limits()
+{
+    cpu_limits limits;
+    limits.online_cpus = int(std::thread::hardware_concurrency());
+    limits.affinity_cpus = limits.online_cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        limits.affinity_cpus = CPU_COUNT(&set);
+    }
+    limits.quota_cpus = read_quota_cpus();
+#endif
+    return limits;
+}
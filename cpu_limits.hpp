@@ -0,0 +1,34 @@
+/*
+ * cpu_limits.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * CPUs actually available to the process, taking container limits into account: the cgroup CPU
+ * bandwidth quota (cgroup v2 cpu.max or v1 cpu.cfs_quota_us) and the CPU affinity mask, which
+ * reflects cpuset limits.
+ */
+
+#pragma once
+#ifndef INCLUDED_CPU_LIMITS_HPP
+#define INCLUDED_CPU_LIMITS_HPP
+
+#include <string>
+
+struct cpu_limits
+{
+    int online_cpus = 0;        // CPUs on the host
+    int affinity_cpus = 0;      // CPUs the process may run on
+    double quota_cpus = 0;      // CPU bandwidth quota in CPUs, or 0 if unlimited
+
+    // Number of threads that can run at once without being throttled
+    int available() const;
+
+    // Number of threads that can run at once on some of the CPUs in the affinity mask (e.g., one
+    // NUMA node's), given those CPUs' proportional share of the quota
+    int available_on(int cpus) const;
+
+    std::string description() const;
+};
+
+cpu_limits read_cpu_limits();
+
+#endif  // INCLUDED_CPU_LIMITS_HPP
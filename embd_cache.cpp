@@ -0,0 +1,240 @@
+/*
+ * embd_cache.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Image embedding cache. Entries are shared pointers, so an entry evicted while a request is
+ * still evaluating it stays alive until that request is done. Cache size is tracked in the
+ * memory accounting under memory_component::embd_cache, and entries of all scopes are evicted in
+ * one LRU order to stay within that budget.
+ *
+ * Snapshot file format (native endianness):
+ *
+ *      char     magic[4]       "EMBD"
+ *      uint32_t version        2
+ *      uint64_t num_entries
+ *      then, for each entry:
+ *          uint8_t  digest[32]     SHA-256 of the encoded image
+ *          uint64_t image_size
+ *          uint64_t num_floats
+ *          float    values[num_floats]
+ */
+
+#include "embd_cache.hpp"
+#include "memory_accounting.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+static const char k_snapshot_magic[4] = { 'E', 'M', 'B', 'D' };
+static constexpr uint32_t k_snapshot_version = 2;
+
+struct embd_cache_entry
+{
+    std::string scope;
+    embd_key key;
+    image_embd_ptr embd;
+};
+
+typedef std::unordered_map<embd_key, std::list<embd_cache_entry>::iterator, embd_key_hash> embd_cache_index;
+
+static std::mutex s_mtx;
+static std::list<embd_cache_entry> s_lru;                   // most recently used first, all scopes
+static std::map<std::string, embd_cache_index> s_index;     // by scope
+
+embd_key embd_cache_key(const uint8_t *image_buffer, size_t image_buffer_size)
+{
+    embd_key key;
+    key.digest = sha256::digest(image_buffer, image_buffer_size);
+    key.image_size = image_buffer_size;
+    return key;
+}
+
+static size_t entry_bytes(const embd_cache_entry &e)
+{
+    return e.embd->size() * sizeof(float);
+}
+
+void embd_cache::set_scope(const std::string &scope)
+{
+    m_scope = scope;
+}
+
+bool embd_cache::enabled() const
+{
+    return memory_budget(memory_component::embd_cache) > 0;
+}
+
+image_embd_ptr embd_cache::find(const embd_key &key)
+{
+    std::lock_guard<std::mutex> lock(s_mtx);
+    embd_cache_index &index = s_index[m_scope];
+    auto it = index.find(key);
+    if (it == index.end())
+    {
+        return nullptr;
+    }
+    s_lru.splice(s_lru.begin(), s_lru, it->second);
+    return it->second->embd;
+}
+
+bool embd_cache::insert(const embd_key &key, image_embd_ptr embd)
+{
+    const int64_t budget = memory_budget(memory_component::embd_cache);
+    const size_t bytes = embd->size() * sizeof(float);
+    if (budget <= 0 || int64_t(bytes) > budget)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(s_mtx);
+    embd_cache_index &index = s_index[m_scope];
+    if (index.count(key))
+    {
+        return true;
+    }
+
+    // Evict the least recently used entries of any scope until the new entry fits. The LRU list
+    // only runs out if other memory has been reserved under the budget, which nothing does.
+    while (!memory_try_reserve(memory_component::embd_cache, bytes))
+    {
+        if (s_lru.empty())
+        {
+            fprintf(stderr, "%s: error: embedding cache budget is exhausted with no entries to evict\n", __func__);
+            return false;
+        }
+        const embd_cache_entry &victim = s_lru.back();
+        memory_release(memory_component::embd_cache, entry_bytes(victim));
+        s_index[victim.scope].erase(victim.key);
+        s_lru.pop_back();
+    }
+
+    s_lru.push_front({ m_scope, key, std::move(embd) });
+    index[key] = s_lru.begin();
+    return true;
+}
+
+bool embd_cache::save(const std::string &filename)
+{
+    FILE *fp = fopen(filename.c_str(), "wb");
+    if (!fp)
+    {
+        fprintf(stderr, "%s: error: unable to write %s\n", __func__, filename.c_str());
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(s_mtx);
+    const uint64_t num_entries = s_index[m_scope].size();
+    bool ok = fwrite(k_snapshot_magic, sizeof(k_snapshot_magic), 1, fp) == 1 &&
+              fwrite(&k_snapshot_version, sizeof(k_snapshot_version), 1, fp) == 1 &&
+              fwrite(&num_entries, sizeof(num_entries), 1, fp) == 1;
+    for (auto it = s_lru.begin(); ok && it != s_lru.end(); ++it)
+    {
+        if (it->scope != m_scope)
+        {
+            continue;
+        }
+        const uint64_t num_floats = it->embd->size();
+        ok = fwrite(it->key.digest.data(), it->key.digest.size(), 1, fp) == 1 &&
+             fwrite(&it->key.image_size, sizeof(it->key.image_size), 1, fp) == 1 &&
+             fwrite(&num_floats, sizeof(num_floats), 1, fp) == 1 &&
+             fwrite(it->embd->data(), sizeof(float), num_floats, fp) == num_floats;
+    }
+    ok = fclose(fp) == 0 && ok;
+    if (!ok)
+    {
+        fprintf(stderr, "%s: error: failed to write %s\n", __func__, filename.c_str());
+    }
+    return ok;
+}
+
+size_t embd_cache::load(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(k_snapshot_magic) + sizeof(uint32_t) + sizeof(uint64_t))
+    {
+        close(fd);
+        return 0;
+    }
+    const size_t size = size_t(st.st_size);
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    // Index the entries first, validating the whole file before anything is inserted
+    struct snapshot_entry
+    {
+        embd_key key;
+        const float *values;
+        uint64_t num_floats;
+    };
+    std::vector<snapshot_entry> entries;
+    const uint8_t *data = (const uint8_t *) mapping;
+    size_t offset = 0;
+    auto read = [&](void *out, size_t bytes) -> bool
+    {
+        if (size - offset < bytes)
+        {
+            return false;
+        }
+        memcpy(out, data + offset, bytes);
+        offset += bytes;
+        return true;
+    };
+
+    char magic[4];
+    uint32_t version = 0;
+    uint64_t num_entries = 0;
+    bool ok = read(magic, sizeof(magic)) && memcmp(magic, k_snapshot_magic, sizeof(magic)) == 0 &&
+              read(&version, sizeof(version)) && version == k_snapshot_version &&
+              read(&num_entries, sizeof(num_entries));
+    for (uint64_t i = 0; ok && i < num_entries; i++)
+    {
+        snapshot_entry entry;
+        ok = read(entry.key.digest.data(), entry.key.digest.size()) && read(&entry.key.image_size, sizeof(entry.key.image_size)) &&
+             read(&entry.num_floats, sizeof(entry.num_floats)) &&
+             entry.num_floats <= (size - offset) / sizeof(float);
+        if (ok)
+        {
+            entry.values = (const float *) (data + offset);     // not necessarily aligned, copied with memcpy below
+            offset += entry.num_floats * sizeof(float);
+            entries.emplace_back(entry);
+        }
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "%s: error: %s is not a valid embedding cache snapshot\n", __func__, filename.c_str());
+        entries.clear();
+    }
+
+    // Least recently used first, so that the most recently used entry ends up at the front
+    for (auto it = entries.rbegin(); it != entries.rend(); ++it)
+    {
+        auto embd = std::make_shared<embd_vector>(it->num_floats);
+        memcpy(embd->data(), it->values, it->num_floats * sizeof(float));
+        insert(it->key, std::move(embd));
+    }
+    munmap(mapping, size);
+
+    // Entries that did not fit, or that later entries evicted, are not counted
+    std::lock_guard<std::mutex> lock(s_mtx);
+    const embd_cache_index &index = s_index[m_scope];
+    return size_t(std::count_if(entries.begin(), entries.end(), [&index](const snapshot_entry &e) { return index.count(e.key) > 0; }));
+}
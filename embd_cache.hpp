@@ -0,0 +1,83 @@
+/*
+ * embd_cache.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Cache of CLIP image embeddings keyed by the SHA-256 digest and size of the encoded image, so
+ * that repeated images skip decoding, preprocessing, and CLIP encoding. Clients control the image
+ * bytes, so the key must be collision resistant: otherwise, a crafted image could be served
+ * another request's embeddings or plant its own for others. Least recently used entries are evicted to
+ * stay within the embedding cache memory budget; without a budget, nothing is cached.
+ *
+ * There is one cache for the whole process, because the budget is process-wide: every backend
+ * (and replica) evicts from the same LRU list. Each embd_cache is a view of the entries of one
+ * scope, the identity of the mmproj that computed them, so backends using the same mmproj share
+ * entries. Entries outlive the backends that inserted them until they are evicted.
+ */
+
+#pragma once
+#ifndef INCLUDED_EMBD_CACHE_HPP
+#define INCLUDED_EMBD_CACHE_HPP
+
+#include "huge_pages.hpp"
+#include "sha256.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Image embeddings are several MiB each, so they are huge page backed when enabled
+typedef std::vector<float, huge_page_allocator<float>> embd_vector;
+typedef std::shared_ptr<const embd_vector> image_embd_ptr;
+
+struct embd_key
+{
+    sha256_digest digest = {};
+    uint64_t image_size = 0;
+
+    bool operator==(const embd_key &other) const
+    {
+        return image_size == other.image_size && digest == other.digest;
+    }
+};
+
+struct embd_key_hash
+{
+    size_t operator()(const embd_key &key) const
+    {
+        size_t hash;
+        memcpy(&hash, key.digest.data(), sizeof(hash));
+        return hash;
+    }
+};
+
+embd_key embd_cache_key(const uint8_t *image_buffer, size_t image_buffer_size);
+
+class embd_cache
+{
+public:
+    // Must be set before the cache is used
+    void set_scope(const std::string &scope);
+
+    bool enabled() const;
+
+    // Returns the cached embeddings, or nullptr on a miss
+    image_embd_ptr find(const embd_key &key);
+
+    // Returns whether the entry is cached afterwards (false if it does not fit in the budget)
+    bool insert(const embd_key &key, image_embd_ptr embd);
+
+    // Writes the entries of this scope to a file, most recently used first
+    bool save(const std::string &filename);
+
+    // Maps a file written by save() and inserts its entries (as far as the budget allows),
+    // preserving their recency order. Returns the number of entries that are cached afterwards.
+    size_t load(const std::string &filename);
+
+private:
+    std::string m_scope;
+};
+
+#endif  // INCLUDED_EMBD_CACHE_HPP
@@ -0,0 +1,241 @@
+/*
+ * huge_pages.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Huge page backing. Our allocations are mmapped in whole 2 MiB pages: with MAP_HUGETLB if
+ * explicit pages were requested and are reserved, and otherwise as 2 MiB aligned anonymous
+ * memory advised with MADV_HUGEPAGE, so that it qualifies even when the system's transparent huge
+ * page setting is "madvise". Linux only; elsewhere, huge pages are always off.
+ */
+
+#include "huge_pages.hpp"
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+
+static constexpr size_t k_huge_page_size = 2 * 1024 * 1024;
+
+static huge_page_mode s_mode = huge_page_mode::off;
+static std::atomic<bool> s_explicit_fallback_logged(false);
+
+static size_t round_up(size_t bytes)
+{
+    return (bytes + k_huge_page_size - 1) & ~(k_huge_page_size - 1);
+}
+
+bool parse_huge_page_mode(const std::string &name, huge_page_mode &mode)
+{
+    if (name == "off")
+    {
+        mode = huge_page_mode::off;
+    }
+    else if (name == "thp")
+    {
+        mode = huge_page_mode::transparent;
+    }
+    else if (name == "explicit")
+    {
+        mode = huge_page_mode::explicit_pages;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+#ifdef __linux__
+// The bracketed word of /sys/kernel/mm/transparent_hugepage/enabled: always, madvise, or never
+static std::string transparent_huge_page_setting()
+{
+    std::ifstream file("/sys/kernel/mm/transparent_hugepage/enabled");
+    std::string line;
+    std::getline(file, line);
+    const size_t open = line.find('[');
+    const size_t close = line.find(']');
+    if (open == std::string::npos || close == std::string::npos || close < open)
+    {
+        return "unavailable";
+    }
+    return line.substr(open + 1, close - open - 1);
+}
+
+static long long free_explicit_huge_pages()
+{
+    std::ifstream meminfo("/proc/meminfo");
+    std::string line;
+    while (std::getline(meminfo, line))
+    {
+        long long pages = 0;
+        if (sscanf(line.c_str(), "HugePages_Free: %lld", &pages) == 1)
+        {
+            return pages;
+        }
+    }
+    return 0;
+}
+#endif
+
+void huge_pages_init(huge_page_mode mode)
+{
+#ifdef __linux__
+    s_mode = mode;
+    if (mode == huge_page_mode::off)
+    {
+        return;
+    }
+    const std::string thp = transparent_huge_page_setting();
+    if (mode == huge_page_mode::explicit_pages)
+    {
+        printf("%s: explicit huge pages: %lld free (reserve more with /proc/sys/vm/nr_hugepages), transparent huge pages: %s\n", __func__,
+            free_explicit_huge_pages(), thp.c_str());
+    }
+    else
+    {
+        printf("%s: transparent huge pages: %s\n", __func__, thp.c_str());
+    }
+    if (thp == "never" || thp == "unavailable")
+    {
+        fprintf(stderr, "%s: warning: transparent huge pages are disabled on this system, so memory allocated by llama.cpp will use regular pages\n", __func__);
+    }
+#else
+    if (mode != huge_page_mode::off)
+    {
+        fprintf(stderr, "%s: warning: huge pages are only supported on Linux\n", __func__);
+    }
+#endif
+}
+
+huge_page_mode huge_pages_mode()
+{
+    return s_mode;
+}
+
+bool huge_pages_use_for(size_t bytes)
+{
+    return s_mode != huge_page_mode::off && bytes >= k_huge_page_size;
+}
+
+void *huge_pages_alloc(size_t bytes)
+{
+#ifdef __linux__
+    const size_t length = round_up(bytes);
+    if (s_mode == huge_page_mode::explicit_pages)
+    {
+        void *ptr = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED)
+        {
+            return ptr;
+        }
+        if (!s_explicit_fallback_logged.exchange(true))
+        {
+            fprintf(stderr, "%s: warning: not enough explicit huge pages reserved, falling back to transparent huge pages\n", __func__);
+        }
+    }
+
+    // Map an extra huge page so that the region can be trimmed to a huge page boundary
+    uint8_t *mapped = static_cast<uint8_t *>(mmap(nullptr, length + k_huge_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (mapped == MAP_FAILED)
+    {
+        return nullptr;
+    }
+    uint8_t *aligned = reinterpret_cast<uint8_t *>(round_up(reinterpret_cast<uintptr_t>(mapped)));
+    const size_t head = size_t(aligned - mapped);
+    if (head > 0)
+    {
+        munmap(mapped, head);
+    }
+    munmap(aligned + length, k_huge_page_size - head);
+    huge_pages_advise(aligned, length);
+    return aligned;
+#else
+    (void) bytes;
+    return nullptr;
+#endif
+}
+
+void huge_pages_free(void *ptr, size_t bytes)
+{
+#ifdef __linux__
+    if (ptr)
+    {
+        munmap(ptr, round_up(bytes));
+    }
+#else
+    (void) ptr;
+    (void) bytes;
+#endif
+}
+
+size_t huge_pages_advise(void *ptr, size_t bytes)
+{
+#ifdef __linux__
+    const uintptr_t start = round_up(reinterpret_cast<uintptr_t>(ptr));
+    const uintptr_t end = (reinterpret_cast<uintptr_t>(ptr) + bytes) & ~uintptr_t(k_huge_page_size - 1);
+    if (end <= start || madvise(reinterpret_cast<void *>(start), end - start, MADV_HUGEPAGE) != 0)
+    {
+        return 0;
+    }
+    return end - start;
+#else
+    (void) ptr;
+    (void) bytes;
+    return 0;
+#endif
+}
+
+huge_page_scope::huge_page_scope(const char *what)
+    : m_what(what)
+{
+    if (s_mode != huge_page_mode::off)
+    {
+        m_before = anonymous_regions();
+    }
+}
+
+huge_page_scope::~huge_page_scope()
+{
+    if (s_mode == huge_page_mode::off)
+    {
+        return;
+    }
+
+    size_t advised = 0;
+    for (const region &r : anonymous_regions())
+    {
+        const bool existed = std::any_of(m_before.begin(), m_before.end(), [&r](const region &b) { return b.start == r.start && b.end == r.end; });
+        if (!existed && r.end - r.start >= k_huge_page_size)
+        {
+            advised += huge_pages_advise(reinterpret_cast<void *>(r.start), r.end - r.start);
+        }
+    }
+    printf("%s: advised transparent huge pages for %.1f MiB allocated by %s\n", __func__, advised / (1024.0 * 1024.0), m_what);
+}
+
+// Writable, private anonymous mappings from /proc/self/maps, whose lines have the form
+// "<start>-<end> <perms> <offset> <dev> <inode> [<path>]"
+std::vector<huge_page_scope::region> huge_page_scope::anonymous_regions()
+{
+    std::vector<region> regions;
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    while (std::getline(maps, line))
+    {
+        unsigned long long start = 0, end = 0, offset = 0, inode = 0;
+        char perms[8] = {};
+        char dev[32] = {};
+        char path[2] = {};
+        const int fields = sscanf(line.c_str(), "%llx-%llx %7s %llx %31s %llu %1s", &start, &end, perms, &offset, dev, &inode, path);
+        if (fields == 6 && inode == 0 && perms[1] == 'w' && perms[3] == 'p')
+        {
+            regions.push_back({ uintptr_t(start), uintptr_t(end) });
+        }
+    }
+    return regions;
+}
@@ -0,0 +1,122 @@
+/*
+ * huge_pages.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Huge page backing for large buffers, which cuts TLB misses on the large, streamed-over regions
+ * that inference touches: the KV cache, compute buffers, image embeddings, and optionally model
+ * weights. Buffers we allocate ourselves can use explicit (hugetlbfs) 2 MiB pages, falling back to
+ * transparent huge pages when none are reserved. Buffers that llama.cpp and CLIP allocate
+ * internally are advised to use transparent huge pages after the fact.
+ */
+
+#pragma once
+#ifndef INCLUDED_HUGE_PAGES_HPP
+#define INCLUDED_HUGE_PAGES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <vector>
+
+enum class huge_page_mode
+{
+    off,
+    transparent,    // madvise(MADV_HUGEPAGE)
+    explicit_pages  // MAP_HUGETLB, falling back to transparent
+};
+
+bool parse_huge_page_mode(const std::string &name, huge_page_mode &mode);
+
+// Sets the mode and logs what the system supports. Must be called before any huge page
+// allocations are made.
+void huge_pages_init(huge_page_mode mode);
+huge_page_mode huge_pages_mode();
+
+// Whether an allocation of this size is made by huge_pages_alloc() rather than operator new
+bool huge_pages_use_for(size_t bytes);
+
+// Allocates whole 2 MiB pages. Returns nullptr if no memory could be mapped at all.
+void *huge_pages_alloc(size_t bytes);
+void huge_pages_free(void *ptr, size_t bytes);
+
+// Advises transparent huge pages for an existing region. Only the 2 MiB aligned pages within it
+// are affected. Returns the number of bytes advised.
+size_t huge_pages_advise(void *ptr, size_t bytes);
+
+// Allocator for containers of large buffers, which are huge page backed when enabled
+template <typename T>
+struct huge_page_allocator
+{
+    typedef T value_type;
+
+    huge_page_allocator() = default;
+
+    template <typename U>
+    huge_page_allocator(const huge_page_allocator<U> &)
+    {
+    }
+
+    T *allocate(size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+        if (!huge_pages_use_for(bytes))
+        {
+            return static_cast<T *>(::operator new(bytes));
+        }
+        void *ptr = huge_pages_alloc(bytes);
+        if (!ptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, size_t n)
+    {
+        const size_t bytes = n * sizeof(T);
+        if (!huge_pages_use_for(bytes))
+        {
+            ::operator delete(ptr);
+            return;
+        }
+        huge_pages_free(ptr, bytes);
+    }
+
+    template <typename U>
+    bool operator==(const huge_page_allocator<U> &) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const huge_page_allocator<U> &) const
+    {
+        return false;
+    }
+};
+
+// Advises transparent huge pages, on destruction, for the anonymous mappings of at least one
+// huge page that were created during its lifetime. This is how buffers allocated inside
+// llama.cpp and CLIP (whose allocations of this size are mmapped by malloc) are covered. Mappings
+// created concurrently by other threads may be advised as well, which is harmless.
+class huge_page_scope
+{
+public:
+    explicit huge_page_scope(const char *what);
+    ~huge_page_scope();
+
+private:
+    struct region
+    {
+        uintptr_t start;
+        uintptr_t end;
+    };
+
+    static std::vector<region> anonymous_regions();
+
+    const char *m_what;
+    std::vector<region> m_before;
+};
+
+#endif  // INCLUDED_HUGE_PAGES_HPP
@@ -0,0 +1,118 @@
+/*
+ * inference_backend.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Helpers shared by inference backends.
+ */
+
+#include "inference_backend.hpp"
+#include "web_server.hpp"
+#include "trace.hpp"
+#include "server_status.hpp"
+#include "slow_log.hpp"
+#include "llava_image.hpp"
+
+#include "llama.cpp/ggml.h"
+
+#include <cstdio>
+#include <cstring>
+
+bool warmup_backend(inference_backend &backend)
+{
+    const int64_t t_start_us = ggml_time_us();
+    metrics_suppressed suppressed;
+
+    // A CLIP-sized image and a handful of tokens exercise every compute graph: batched prompt
+    // prefill, image embedding prefill, and single-token generation
+    std::vector<uint8_t> bmp = make_synthetic_bmp(336, 336);
+    llava_request request;
+    request.user_prompt = "Describe the image.";
+    request.image = std::shared_ptr<uint8_t[]>(new uint8_t[bmp.size()]);
+    request.image_buffer_size = bmp.size();
+    request.n_predict = 4;
+    request.warmup = true;
+    memcpy(request.image.get(), bmp.data(), bmp.size());
+
+    httplib::Response response;
+    inference_timings timings;
+    std::unique_ptr<prepared_input> input = backend.prepare(request, response, timings);
+    if (input)
+    {
+        backend.perform_inference(request, *input, response, t_start_us, timings);
+    }
+    if (is_error_response(response))
+    {
+        fprintf(stderr, "%s: error: warmup request failed: %s\n", __func__, response.body.c_str());
+        return false;
+    }
+
+    printf("%s: warmup completed in %.2f ms\n", __func__, (ggml_time_us() - t_start_us) / 1000.0);
+    return true;
+}
+
+int64_t record_stage(metric_stage stage, const char *trace_name, int64_t t_start_us, int64_t t_end_us)
+{
+    const int64_t duration_us = t_end_us - t_start_us;
+    metrics_observe(stage, duration_us);
+    trace_span(trace_name, "request", t_start_us, duration_us);
+    slow_log_stage(trace_name, t_start_us, duration_us);
+    return duration_us;
+}
+
+void record_token(inference_timings &timings, bool first_token, int64_t t_hand_off_us, int64_t t_prev_token_us, int64_t t_token_us)
+{
+    if (first_token)
+    {
+        timings.time_to_first_token_us = t_token_us - t_hand_off_us;
+        metrics_observe(metric_stage::time_to_first_token, timings.time_to_first_token_us);
+    }
+    else
+    {
+        metrics_observe(metric_stage::inter_token, t_token_us - t_prev_token_us);
+    }
+}
+
+void count_generated_token(inference_timings &timings, int64_t t_hand_off_us, int64_t t_token_us)
+{
+    timings.n_generated_tokens++;
+    timings.time_to_last_token_us = t_token_us - t_hand_off_us;
+    metrics_increment(metric_counter::tokens_generated);
+    if (!metrics_suppressed::active())
+    {
+        server_status_record_tokens(1);
+    }
+}
+
+void set_error_response(httplib::Response &web_response, const std::string &description)
+{
+    web_response.set_content("{\"error\": true, \"description\": \"" + escape_json(description) + "\"}", "application/json");
+    metrics_increment(metric_counter::errors);
+}
+
+bool drain_deadline_passed(httplib::Response &web_response)
+{
+    if (!server_status_drain_expired())
+    {
+        return false;
+    }
+    web_response.status = 503;
+    set_error_response(web_response, "server is shutting down");
+    return true;
+}
+
+void set_success_response(
+    httplib::Response &web_response,
+    const std::string &content,
+    inference_timings &timings,
+    int64_t t_hand_off_us,
+    int64_t t_generation_start_us
+)
+{
+    const int64_t t_generation_end_us = ggml_time_us();
+    timings.generation_us = t_generation_end_us - t_generation_start_us;
+    timings.total_us = t_generation_end_us - t_hand_off_us;
+    trace_span("generate", "request", t_generation_start_us, timings.generation_us, "{\"n_tokens\": " + std::to_string(timings.n_generated_tokens) + "}");
+
+    web_response.set_header("Server-Timing", timings_to_server_timing(timings));
+    web_response.set_content("{\"error\": false, \"content\": \"" + escape_json(content) + "\", \"timings\": " + timings_to_json(timings) + "}", "application/json");
+}
@@ -0,0 +1,103 @@
+/*
+ * inference_backend.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Interface to an inference backend, which turns a LLaVA request into a JSON response, plus
+ * helpers shared by backends so that they all report timings, metrics, and traces identically.
+ */
+
+#pragma once
+#ifndef INCLUDED_INFERENCE_BACKEND_HPP
+#define INCLUDED_INFERENCE_BACKEND_HPP
+
+#include "llava_request.hpp"
+#include "inference_timings.hpp"
+#include "metrics.hpp"
+#include "cpp-httplib/httplib.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Backend-specific state that inference_backend::prepare() hands to perform_inference()
+struct prepared_input
+{
+    virtual ~prepared_input() = default;
+};
+
+class inference_backend
+{
+public:
+    virtual ~inference_backend() = default;
+
+    // True if perform_inference() may be called concurrently (the backend then serializes
+    // requests itself as needed)
+    virtual bool concurrent() const { return false; }
+
+    // Work that does not need the backend to itself, such as decoding the image. Unlike
+    // perform_inference(), calls are not serialized, so this overlaps with other requests'
+    // inference. Returns nullptr after setting an error response.
+    virtual std::unique_ptr<prepared_input> prepare(
+        const llava_request & /*request*/,
+        httplib::Response & /*web_response*/,
+        inference_timings & /*timings*/
+    )
+    {
+        return std::make_unique<prepared_input>();
+    }
+
+    // Processes a request that was handed off at t_hand_off_us (ggml_time_us() clock) and then
+    // prepared, filling in the response. timings.queue_wait_us has already been set by the
+    // caller. Calls are serialized by the caller.
+    virtual void perform_inference(
+        const llava_request &request,
+        prepared_input &input,
+        httplib::Response &web_response,
+        int64_t t_hand_off_us,
+        inference_timings &timings
+    ) = 0;
+
+    // Warm-restart snapshots of whatever the backend caches. Files are named by appending a
+    // suffix to path_prefix. Loading skips (and keeps) snapshots that do not match the backend's
+    // current model files. Neither is called while a request is being processed.
+    virtual bool save_snapshot(const std::string & /*path_prefix*/) { return true; }
+    virtual void load_snapshot(const std::string & /*path_prefix*/) {}
+
+    // Memory the backend holds beyond its model files, such as the KV cache and buffers, for
+    // sizing the number of models kept resident
+    virtual int64_t context_bytes() const { return 0; }
+};
+
+// Runs a synthetic image and prompt through the full pipeline so that weights are paged in and
+// compute buffers are allocated before the first real request. The request is left out of
+// metrics, load statistics, and the embedding cache.
+bool warmup_backend(inference_backend &backend);
+
+// Records a completed request stage in metrics, the trace, and the slow request log, returning
+// its duration
+int64_t record_stage(metric_stage stage, const char *trace_name, int64_t t_start_us, int64_t t_end_us);
+
+// Records the time at which a token was produced: time to first token for the first one,
+// inter-token latency for the rest
+void record_token(inference_timings &timings, bool first_token, int64_t t_hand_off_us, int64_t t_prev_token_us, int64_t t_token_us);
+
+// Counts a generated token, sampled at t_token_us, in the request timings, metrics, and load
+// statistics
+void count_generated_token(inference_timings &timings, int64_t t_hand_off_us, int64_t t_token_us);
+
+void set_error_response(httplib::Response &web_response, const std::string &description);
+
+// Checked between generated tokens. Once the shutdown drain deadline has passed, sets a 503
+// response and returns true, and the request should stop.
+bool drain_deadline_passed(httplib::Response &web_response);
+
+// Completes timings for generation (started at t_generation_start_us) and writes the response
+void set_success_response(
+    httplib::Response &web_response,
+    const std::string &content,
+    inference_timings &timings,
+    int64_t t_hand_off_us,
+    int64_t t_generation_start_us
+);
+
+#endif  // INCLUDED_INFERENCE_BACKEND_HPP
@@ -0,0 +1,74 @@
+/*
+ * inference_timings.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Formatting of per-request timing breakdowns.
+ */
+
+#include "inference_timings.hpp"
+
+#include <cstdio>
+
+static double to_ms(int64_t us)
+{
+    return us / 1000.0;
+}
+
+static double tokens_per_second(int n_tokens, int64_t us)
+{
+    return us > 0 ? n_tokens * 1e6 / us : 0.0;
+}
+
+std::string timings_to_json(const inference_timings &timings)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf),
+        "{"
+        "\"queue_wait_ms\": %.3f, "
+        "\"image_decode_ms\": %.3f, "
+        "\"preprocess_ms\": %.3f, "
+        "\"clip_encode_ms\": %.3f, "
+        "\"prompt_prefill_ms\": %.3f, "
+        "\"time_to_first_token_ms\": %.3f, "
+        "\"time_to_last_token_ms\": %.3f, "
+        "\"generation_ms\": %.3f, "
+        "\"total_ms\": %.3f, "
+        "\"prompt_tokens\": %d, "
+        "\"generated_tokens\": %d, "
+        "\"prompt_tokens_per_second\": %.2f, "
+        "\"generated_tokens_per_second\": %.2f"
+        "}",
+        to_ms(timings.queue_wait_us),
+        to_ms(timings.image_decode_us),
+        to_ms(timings.preprocess_us),
+        to_ms(timings.clip_encode_us),
+        to_ms(timings.prompt_prefill_us),
+        to_ms(timings.time_to_first_token_us),
+        to_ms(timings.time_to_last_token_us),
+        to_ms(timings.generation_us),
+        to_ms(timings.total_us),
+        timings.n_prompt_tokens,
+        timings.n_generated_tokens,
+        tokens_per_second(timings.n_prompt_tokens, timings.prompt_prefill_us),
+        tokens_per_second(timings.n_generated_tokens, timings.generation_us)
+    );
+    return buf;
+}
+
+std::string timings_to_server_timing(const inference_timings &timings)
+{
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+        "queue;dur=%.3f, decode;dur=%.3f, preprocess;dur=%.3f, encode;dur=%.3f, prefill;dur=%.3f, "
+        "ttft;dur=%.3f, generate;dur=%.3f, total;dur=%.3f",
+        to_ms(timings.queue_wait_us),
+        to_ms(timings.image_decode_us),
+        to_ms(timings.preprocess_us),
+        to_ms(timings.clip_encode_us),
+        to_ms(timings.prompt_prefill_us),
+        to_ms(timings.time_to_first_token_us),
+        to_ms(timings.generation_us),
+        to_ms(timings.total_us)
+    );
+    return buf;
+}
@@ -0,0 +1,37 @@
+/*
+ * inference_timings.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Per-request timing breakdown, returned to clients in the response body and in a Server-Timing
+ * header.
+ */
+
+#pragma once
+#ifndef INCLUDED_INFERENCE_TIMINGS_HPP
+#define INCLUDED_INFERENCE_TIMINGS_HPP
+
+#include <cstdint>
+#include <string>
+
+struct inference_timings
+{
+    int64_t queue_wait_us = 0;
+    int64_t image_decode_us = 0;
+    int64_t preprocess_us = 0;
+    int64_t clip_encode_us = 0;
+    int64_t prompt_prefill_us = 0;
+    int64_t time_to_first_token_us = 0;     // measured from hand-off, so includes all of the above
+    int64_t time_to_last_token_us = 0;      // to the last token returned, not the end-of-sequence token
+    int64_t generation_us = 0;
+    int64_t total_us = 0;
+    int n_prompt_tokens = 0;                // includes image embedding positions
+    int n_generated_tokens = 0;
+};
+
+// JSON object (without a key), e.g. {"queue_wait_ms": 0.01, ...}
+std::string timings_to_json(const inference_timings &timings);
+
+// Value for the Server-Timing header, e.g. queue;dur=0.01, decode;dur=3.20, ...
+std::string timings_to_server_timing(const inference_timings &timings);
+
+#endif  // INCLUDED_INFERENCE_TIMINGS_HPP
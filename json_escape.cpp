@@ -0,0 +1,54 @@
+/*
+ * json_escape.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Escaping of strings embedded in JSON output.
+ */
+
+#include "json_escape.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+std::string escape_json(const std::string &s)
+{
+    std::ostringstream o;
+    for (auto c = s.cbegin(); c != s.cend(); c++)
+    {
+        switch (*c)
+        {
+        case '"':
+            o << "\\\"";
+            break;
+        case '\\':
+            o << "\\\\";
+            break;
+        case '\b':
+            o << "\\b";
+            break;
+        case '\f':
+            o << "\\f";
+            break;
+        case '\n':
+            o << "\\n";
+            break;
+        case '\r':
+            o << "\\r";
+            break;
+        case '\t':
+            o << "\\t";
+            break;
+        default:
+            if ('\x00' <= *c && *c <= '\x1f')
+            {
+                o << "\\u"
+                  << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(*c);
+            }
+            else
+            {
+                o << *c;
+            }
+        }
+    }
+    return o.str();
+}
@@ -0,0 +1,18 @@
+/*
+ * json_escape.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Escaping of strings embedded in JSON output. Kept apart from the web server so that modules
+ * linked into the tools (e.g., tracing) can use it.
+ */
+
+#pragma once
+#ifndef INCLUDED_JSON_ESCAPE_HPP
+#define INCLUDED_JSON_ESCAPE_HPP
+
+#include <string>
+
+// Escapes a string for use between the quotes of a JSON string
+std::string escape_json(const std::string &s);
+
+#endif  // INCLUDED_JSON_ESCAPE_HPP
@@ -0,0 +1,559 @@
+/*
+ * llava_backend.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Inference backend that runs LLaVA using llama.cpp: CLIP encodes the image, and the resulting
+ * embeddings are evaluated by LLaMA along with the prompt.
+ *
+ * The system prompt and "USER:" prefix is left in the KV cache after each request and reused when
+ * the next request has the same one, which is the common case. Only the rest of the prompt is
+ * removed and evaluated.
+ *
+ * The system prompt and image stay pinned at the start of the context. A user prompt too long to
+ * fit after them loses its oldest tokens, and when generation fills the context, the oldest half
+ * of what follows the image is discarded and the rest shifted down in the KV cache, rather than
+ * evaluating it again.
+ *
+ * With huge pages enabled, the buffers llama.cpp and CLIP allocate while loading are advised to
+ * use them: the CLIP weights and compute buffer, the KV cache and compute buffers of the context,
+ * and, if requested, LLM weights loaded into memory.
+ *
+ * llama.cpp does not report the size of a context's compute buffer through its API, so it is
+ * estimated from the context and model dimensions for memory accounting.
+ */
+
+#include "llava_backend.hpp"
+#include "huge_pages.hpp"
+#include "llava_eval.hpp"
+#include "llava_image.hpp"
+#include "memory_accounting.hpp"
+#include "mmproj_quant.hpp"
+#include "slow_log.hpp"
+#include "stage_threads.hpp"
+#include "trace.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <thread>
+
+// The request image, looked up in the embedding cache and, on a miss, decoded and preprocessed
+struct llava_prepared_input : public prepared_input
+{
+    embd_key image_key;
+    image_embd_ptr cached_embd;     // set on an embedding cache hit
+    clip_image_f32 image;           // valid if has_image
+    bool has_image = false;
+
+    ~llava_prepared_input() override
+    {
+        if (has_image)
+        {
+            free_image_data(&image);
+        }
+    }
+};
+
+// The compute buffer is sized for the worst-case graph, a full batch evaluated against the whole
+// context. Its largest tensors live at once are the attention scores of every head, the logits,
+// and the feed-forward and residual activations, all f32. Heads are assumed to be 128 wide and the
+// feed-forward layer about 3x the embedding width, as in LLaMA models.
+static int64_t estimate_compute_bytes(const llama_model *model, int n_ctx, int n_batch)
+{
+    const int64_t n_tokens = std::min(n_ctx, n_batch);
+    const int64_t n_embd = llama_n_embd(model);
+    const int64_t n_head = std::max<int64_t>(1, n_embd / 128);
+    const int64_t n_vocab = llama_n_vocab(model);
+    const int64_t n_floats = n_tokens * (n_head * n_ctx + n_vocab + 2 * 3 * n_embd + 4 * n_embd);
+    return n_floats * int64_t(sizeof(float));
+}
+
+llava_backend::llava_backend(const gpt_params &params, const llava_backend_options &options)
+    : m_params(params),
+      m_options(options),
+      m_mmproj_path(params.mmproj)
+{
+    if (m_options.n_threads_clip <= 0)
+    {
+        m_options.n_threads_clip = params.n_threads;
+    }
+}
+
+llava_backend::~llava_backend()
+{
+    if (m_ctx_llama)
+    {
+        llama_free(m_ctx_llama);
+    }
+    if (m_model)
+    {
+        llama_free_model(m_model);
+        memory_unregister_file(m_params.model);
+    }
+    memory_add_allocated(memory_component::model_weights, -m_model_bytes);
+    memory_add_allocated(memory_component::kv_cache, -m_kv_bytes);
+    memory_add_used(memory_component::kv_cache, -m_kv_used_bytes);
+    memory_add_allocated(memory_component::buffer_pools, -m_compute_bytes - int64_t(m_image_embd.size() * sizeof(float)));
+    if (m_slot_id >= 0)
+    {
+        memory_remove_slot(m_slot_id);
+    }
+}
+
+// Asks the kernel to start reading a whole file into the page cache in the background
+static void readahead_file(const std::string &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    close(fd);
+}
+
+// Canonical path, size, and modification time of a file
+static std::string file_identity(const std::string &path)
+{
+    char resolved[PATH_MAX];
+    struct stat st;
+    if (!realpath(path.c_str(), resolved) || stat(resolved, &st) != 0)
+    {
+        return path;
+    }
+    return std::string(resolved) + ":" + std::to_string(st.st_size) + ":" + std::to_string(st.st_mtime);
+}
+
+std::string llava_backend::model_identity() const
+{
+    return file_identity(m_params.model) + " n_ctx=" + std::to_string(llama_n_ctx(m_ctx_llama));
+}
+
+std::string llava_backend::mmproj_identity() const
+{
+    return file_identity(m_mmproj_path);
+}
+
+bool llava_backend::load()
+{
+    const int64_t t_load_start_us = ggml_time_us();
+
+    // Start reading both files into the page cache up front so that their I/O overlaps
+    readahead_file(m_params.mmproj);
+    readahead_file(m_params.model);
+
+    // CLIP and LLaMA are independent of each other, so load CLIP on its own thread while the LLM
+    // and its context are created on this one. If another backend already uses this mmproj, its
+    // CLIP context is shared instead.
+    int64_t t_clip_end_us = 0;
+    std::thread clip_thread([this, &t_clip_end_us]()
+    {
+        trace_set_thread_name("clip_load");
+        if (!m_options.mmproj_quant.empty())
+        {
+            const std::string quantized_path = mmproj_quantized_path(m_params.mmproj, m_options.mmproj_quant, m_options.mmproj_cache_dir);
+            if (quantized_path.empty())
+            {
+                fprintf(stderr, "%s: warning: using the unquantized mmproj\n", __func__);
+            }
+            else
+            {
+                m_mmproj_path = quantized_path;
+            }
+        }
+        huge_page_scope huge_pages("CLIP");
+        m_clip = clip_cache_load(m_mmproj_path, m_options.numa_node);
+        t_clip_end_us = ggml_time_us();
+    });
+
+    llama_backend_init(m_params.numa);
+
+    // Weights that are to be local to a NUMA node must be private to this model rather than mapped
+    // from the file
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = m_params.use_mmap;
+    {
+        std::unique_ptr<huge_page_scope> huge_pages;
+        if (m_options.huge_page_weights && !model_params.use_mmap)
+        {
+            huge_pages = std::make_unique<huge_page_scope>("model weights");
+        }
+        m_model = llama_load_model_from_file(m_params.model.c_str(), model_params);
+    }
+    if (m_model == NULL)
+    {
+        clip_thread.join();
+        fprintf(stderr , "%s: error: unable to load model\n" , __func__);
+        return false;
+    }
+    const int64_t t_model_end_us = ggml_time_us();
+
+    // Mapped weights are reported from /proc/self/smaps; otherwise they are allocated
+    memory_register_file(memory_component::model_weights, m_params.model);
+    if (!model_params.use_mmap)
+    {
+        m_model_bytes = int64_t(llama_model_size(m_model));
+        memory_add_allocated(memory_component::model_weights, m_model_bytes);
+    }
+
+    llama_context_params ctx_params = llama_context_default_params();
+
+    ctx_params.n_ctx           = m_params.n_ctx < 2048 ? 2048 : m_params.n_ctx; // we need a longer context size to process image embeddings
+    ctx_params.n_batch         = uint32_t(m_params.n_batch);
+    ctx_params.f16_kv          = m_params.memory_f16;
+    ctx_params.n_threads       = m_params.n_threads;
+    ctx_params.n_threads_batch = m_params.n_threads_batch == -1 ? m_params.n_threads : m_params.n_threads_batch;
+
+    // create a llama context once that we'll reuse for each request
+    {
+        huge_page_scope huge_pages("KV cache and compute buffers");
+        m_ctx_llama = llama_new_context_with_model(m_model, ctx_params);
+    }
+    if (m_ctx_llama == NULL)
+    {
+        clip_thread.join();
+        fprintf(stderr , "%s: error: failed to create the llama_context\n" , __func__);
+        return false;
+    }
+    const int64_t t_context_end_us = ggml_time_us();
+
+    clip_thread.join();
+    if (!m_clip)
+    {
+        fprintf(stderr , "%s: error: unable to load CLIP model\n" , __func__);
+        return false;
+    }
+
+    // Embeddings are shared with every backend that uses the same mmproj
+    m_embd_cache.set_scope(mmproj_identity());
+    const int64_t t_load_end_us = ggml_time_us();
+
+    trace_span("clip_load", "startup", t_load_start_us, t_clip_end_us - t_load_start_us);
+    trace_span("model_load", "startup", t_load_start_us, t_model_end_us - t_load_start_us);
+    trace_span("context_create", "startup", t_model_end_us, t_context_end_us - t_model_end_us);
+    printf("%s: CLIP loaded in %.2f ms, LLM in %.2f ms, context created in %.2f ms (total: %.2f ms)\n", __func__,
+        (t_clip_end_us - t_load_start_us) / 1000.0, (t_model_end_us - t_load_start_us) / 1000.0,
+        (t_context_end_us - t_model_end_us) / 1000.0, (t_load_end_us - t_load_start_us) / 1000.0);
+
+    // The state size is dominated by the KV cache (it also includes the logits buffer)
+    m_kv_bytes = int64_t(llama_get_state_size(m_ctx_llama));
+    memory_add_allocated(memory_component::kv_cache, m_kv_bytes);
+    set_kv_used(0);
+
+    m_image_embd.resize(clip_embd_nbytes(m_clip->ctx) / sizeof(float));
+    const int64_t buffer_bytes = int64_t(m_image_embd.size() * sizeof(float));
+    const int n_ctx = llama_n_ctx(m_ctx_llama);
+    m_compute_bytes = estimate_compute_bytes(m_model, n_ctx, int(ctx_params.n_batch));
+    memory_add_allocated(memory_component::buffer_pools, m_compute_bytes + buffer_bytes);
+    m_slot_id = memory_add_slot(m_kv_bytes, m_compute_bytes, buffer_bytes);
+    printf("%s: KV cache (%s): %.1f MiB for %d tokens (%.1f KiB per token), compute buffer: ~%.1f MiB, %.1f MiB per slot\n", __func__,
+        ctx_params.f16_kv ? "f16" : "f32", m_kv_bytes / (1024.0 * 1024.0), n_ctx, m_kv_bytes / 1024.0 / n_ctx,
+        m_compute_bytes / (1024.0 * 1024.0), context_bytes() / (1024.0 * 1024.0));
+
+    return true;
+}
+
+void llava_backend::set_kv_used(int64_t bytes)
+{
+    memory_add_used(memory_component::kv_cache, bytes - m_kv_used_bytes);
+    m_kv_used_bytes = bytes;
+}
+
+int64_t llava_backend::context_bytes() const
+{
+    return m_kv_bytes + m_compute_bytes + int64_t(m_image_embd.size() * sizeof(float));
+}
+
+std::unique_ptr<prepared_input> llava_backend::prepare(const llava_request &request, httplib::Response &web_response, inference_timings &timings)
+{
+    clip_ctx *ctx_clip = m_clip->ctx;
+    auto input = std::make_unique<llava_prepared_input>();
+
+    if (m_embd_cache.enabled())
+    {
+        input->image_key = embd_cache_key(request.image.get(), request.image_buffer_size);
+        input->cached_embd = m_embd_cache.find(input->image_key);
+        if (input->cached_embd)
+        {
+            metrics_increment(metric_counter::cache_hits);
+            slow_log_set_cache_status("hit");
+            return input;
+        }
+        slow_log_set_cache_status("miss");
+    }
+
+    stage_affinity affinity(pipeline_stage::preprocess);
+
+    // load and preprocess the image
+    clip_image_u8 img;
+
+    const int64_t t_img_dec_start_us = ggml_time_us();
+    if (!clip_image_load_from_memory(request.image.get(), request.image_buffer_size, &img))
+    {
+        set_error_response(web_response, "unable to load image");
+        return nullptr;
+    }
+    const int64_t t_img_dec_end_us = ggml_time_us();
+    timings.image_decode_us = record_stage(metric_stage::image_decode, "image_decode", t_img_dec_start_us, t_img_dec_end_us);
+    slow_log_set_image(img.nx, img.ny);
+
+    input->has_image = clip_image_preprocess(ctx_clip, &img, &input->image, /*pad2square =*/ true);
+    free_image_data(&img);
+    if (!input->has_image)
+    {
+        fprintf(stderr, "%s: unable to preprocess image\n", __func__);
+        set_error_response(web_response, "unable to preprocess image");
+        return nullptr;
+    }
+    const int64_t t_img_pre_end_us = ggml_time_us();
+    timings.preprocess_us = record_stage(metric_stage::preprocess, "preprocess", t_img_dec_end_us, t_img_pre_end_us);
+
+    return input;
+}
+
+bool llava_backend::encode_image(clip_image_f32 &image, httplib::Response &web_response, inference_timings &timings)
+{
+    clip_ctx *ctx_clip = m_clip->ctx;
+
+    stage_affinity affinity(pipeline_stage::clip);
+    std::unique_lock<std::mutex> clip_lock(m_clip->encode_mtx);
+    const int64_t t_img_enc_start_us = ggml_time_us();
+    const bool encoded = clip_image_encode(ctx_clip, m_options.n_threads_clip, &image, m_image_embd.data());
+    clip_lock.unlock();
+    if (!encoded)
+    {
+        fprintf(stderr, "Unable to encode image\n");
+        set_error_response(web_response, "unable to encode image");
+        return false;
+    }
+    const int64_t t_img_enc_end_us = ggml_time_us();
+    timings.clip_encode_us = record_stage(metric_stage::clip_encode, "clip_encode", t_img_enc_start_us, t_img_enc_end_us);
+
+    const float t_img_enc_ms = (t_img_enc_end_us - t_img_enc_start_us) / 1000.0;
+    printf("\n%s: image encoded in %8.2f ms by CLIP (%8.2f ms per image patch)\n", __func__, t_img_enc_ms, t_img_enc_ms / clip_n_patches(ctx_clip));
+
+    return true;
+}
+
+void llava_backend::perform_inference(
+    const llava_request &request,
+    prepared_input &input,
+    httplib::Response &web_response,
+    int64_t t_hand_off_us,
+    inference_timings &timings
+)
+{
+    gpt_params &params = m_params;
+    clip_ctx *ctx_clip = m_clip->ctx;
+    llama_context *ctx_llama = m_ctx_llama;
+    llava_prepared_input &prepared = static_cast<llava_prepared_input &>(input);
+
+    std::cout << "Processing request:" << std::endl
+              << "  System prompt: " << request.system_prompt << std::endl
+              << "  User prompt  : " << request.user_prompt << std::endl
+              << "  Image        : " << request.image_buffer_size << " bytes" << std::endl
+              << std::endl;
+
+    int n_img_pos  = clip_n_patches(ctx_clip);
+    int n_img_embd = clip_n_mmproj_embd(ctx_clip);
+
+    // make sure that the correct mmproj was used, i.e., compare apples to apples
+    int n_llama_embd = llama_n_embd(llama_get_model(ctx_llama));
+    if (n_img_embd != n_llama_embd)
+    {
+        printf("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_img_embd, n_llama_embd);
+        set_error_response(web_response, "multimodal projector embedding dimensions are not equal to LLaMA, which may indicate the wrong mmproj file is being used");
+        return;
+    }
+
+    // image embeddings, either cached or freshly encoded
+    const float *image_embd = m_image_embd.data();
+    if (prepared.cached_embd)
+    {
+        image_embd = prepared.cached_embd->data();
+    }
+    else
+    {
+        if (!encode_image(prepared.image, web_response, timings))
+        {
+            return;
+        }
+        if (m_embd_cache.enabled() && !request.warmup)
+        {
+            m_embd_cache.insert(prepared.image_key, std::make_shared<const embd_vector>(m_image_embd));
+        }
+    }
+
+    stage_affinity affinity(pipeline_stage::llm);
+
+    // process the prompt
+    // llava chat format is "<system_prompt>USER: <image_embeddings>\n<textual_prompt>\nASSISTANT:"
+
+    int n_past = 0;
+    const int n_ctx = llama_n_ctx(ctx_llama);
+
+    const int max_tgt_len = request.n_predict >= 0 ? request.n_predict : (params.n_predict < 0 ? 256 : params.n_predict);
+
+    // GG: are we sure that the should be a trailing whitespace at the end of this string?
+    const int64_t t_prefill_start_us = ggml_time_us();
+    std::string prompt = request.system_prompt + "\nUSER: ";
+    std::vector<llama_token> prefix_tokens = ::llama_tokenize(ctx_llama, prompt, true);
+    std::vector<llama_token> user_tokens = ::llama_tokenize(ctx_llama, request.user_prompt, true);
+    const std::vector<llama_token> suffix_tokens = ::llama_tokenize(ctx_llama, "\nASSISTANT:", true);
+
+    // The system prompt and image are pinned at the start of the context. If the user prompt does
+    // not fit after them with room left to generate, its oldest text is dropped.
+    const int n_pinned = int(prefix_tokens.size()) + n_img_pos;
+    const int n_room = n_ctx - n_pinned - int(suffix_tokens.size());
+    const int n_max_user_tokens = n_room - std::min(max_tgt_len, n_room / 4);
+    if (n_max_user_tokens <= 0)
+    {
+        set_error_response(web_response, "system prompt and image do not fit in the context");
+        return;
+    }
+    if (int(user_tokens.size()) > n_max_user_tokens)
+    {
+        const size_t n_drop = user_tokens.size() - size_t(n_max_user_tokens);
+        printf("%s: prompt does not fit in the context (n_ctx = %d), dropping its first %zu tokens\n", __func__, n_ctx, n_drop);
+        user_tokens.erase(user_tokens.begin(), user_tokens.begin() + n_drop);
+        metrics_increment(metric_counter::prompt_truncations);
+    }
+    if (!m_prefix_tokens.empty() && prefix_tokens == m_prefix_tokens)
+    {
+        // Keep the prefix, clear the rest of the previous request
+        n_past = int(m_prefix_tokens.size());
+        llama_kv_cache_seq_rm(ctx_llama, 0, n_past, -1);
+    }
+    else
+    {
+        // Clear state
+        llama_kv_cache_tokens_rm(ctx_llama, -1, -1);
+        m_prefix_tokens.clear();
+        if (llava_eval_tokens(ctx_llama, prefix_tokens, params.n_batch, &n_past))
+        {
+            m_prefix_tokens = prefix_tokens;
+        }
+    }
+    llava_eval_image_embd(ctx_llama, image_embd, n_img_pos, params.n_batch, &n_past);
+    llava_eval_tokens(ctx_llama, user_tokens,   params.n_batch, &n_past);
+    llava_eval_tokens(ctx_llama, suffix_tokens, params.n_batch, &n_past);
+    const int64_t t_prefill_end_us = ggml_time_us();
+    timings.prompt_prefill_us = record_stage(metric_stage::prompt_prefill, "prompt_prefill", t_prefill_start_us, t_prefill_end_us);
+    timings.n_prompt_tokens = n_past;
+
+    // generate the response
+
+    printf("\n");
+    std::string output;
+    int64_t t_last_token_us = t_prefill_end_us;
+    for (int i = 0; i < max_tgt_len; i++)
+    {
+        if (drain_deadline_passed(web_response))
+        {
+            return;
+        }
+        if (n_past >= n_ctx)
+        {
+            // Drop the oldest text after the pinned system prompt and image
+            llava_shift_context(ctx_llama, n_pinned, &n_past);
+            metrics_increment(metric_counter::context_shifts);
+        }
+        const std::string tmp = llava_sample(ctx_llama, params, &n_past);
+        const int64_t t_token_us = ggml_time_us();
+        record_token(timings, i == 0, t_hand_off_us, t_last_token_us, t_token_us);
+        t_last_token_us = t_token_us;
+        if (tmp == "</s>") break;
+
+        count_generated_token(timings, t_hand_off_us, t_token_us);
+        output += tmp;
+        printf("%s", tmp.c_str());
+        fflush(stdout);
+    }
+
+    set_success_response(web_response, output, timings, t_hand_off_us, t_prefill_end_us);
+    set_kv_used(m_kv_bytes * n_past / llama_n_ctx(ctx_llama));
+
+    printf("\n");
+
+    llama_print_timings(ctx_llama);
+}
+
+bool llava_backend::save_snapshot(const std::string &path_prefix)
+{
+    bool ok = true;
+
+    // Trim the KV cache down to the prefix so that only the prefix is saved
+    if (!m_prefix_tokens.empty())
+    {
+        llama_kv_cache_seq_rm(m_ctx_llama, 0, int(m_prefix_tokens.size()), -1);
+        const std::string kv_file = path_prefix + ".kv";
+        if (!llama_save_session_file(m_ctx_llama, kv_file.c_str(), m_prefix_tokens.data(), m_prefix_tokens.size()))
+        {
+            fprintf(stderr, "%s: error: unable to write %s\n", __func__, kv_file.c_str());
+            ok = false;
+        }
+    }
+
+    if (m_embd_cache.enabled())
+    {
+        ok = m_embd_cache.save(path_prefix + ".embd") && ok;
+    }
+
+    std::ofstream meta(path_prefix + ".meta");
+    meta << model_identity() << std::endl << mmproj_identity() << std::endl;
+    if (!meta)
+    {
+        fprintf(stderr, "%s: error: unable to write %s.meta\n", __func__, path_prefix.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+void llava_backend::load_snapshot(const std::string &path_prefix)
+{
+    std::ifstream meta(path_prefix + ".meta");
+    std::string model, mmproj;
+    if (!std::getline(meta, model) || !std::getline(meta, mmproj))
+    {
+        return;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    size_t n_prefix = 0;
+    if (model == model_identity())
+    {
+        std::vector<llama_token> tokens(llama_n_ctx(m_ctx_llama));
+        const std::string kv_file = path_prefix + ".kv";
+        if (access(kv_file.c_str(), R_OK) == 0 &&
+            llama_load_session_file(m_ctx_llama, kv_file.c_str(), tokens.data(), tokens.size(), &n_prefix))
+        {
+            tokens.resize(n_prefix);
+            m_prefix_tokens = tokens;
+            set_kv_used(m_kv_bytes * int64_t(n_prefix) / llama_n_ctx(m_ctx_llama));
+        }
+        else
+        {
+            n_prefix = 0;
+        }
+    }
+
+    size_t n_embd = 0;
+    if (mmproj == mmproj_identity() && m_embd_cache.enabled())
+    {
+        n_embd = m_embd_cache.load(path_prefix + ".embd");
+    }
+
+    printf("%s: restored %zu prefix tokens and %zu image embeddings from %s in %.2f ms\n", __func__,
+        n_prefix, n_embd, path_prefix.c_str(), (ggml_time_us() - t_start_us) / 1000.0);
+}
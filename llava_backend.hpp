@@ -0,0 +1,85 @@
+/*
+ * llava_backend.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Inference backend that runs LLaVA using llama.cpp.
+ */
+
+#pragma once
+#ifndef INCLUDED_LLAVA_BACKEND_HPP
+#define INCLUDED_LLAVA_BACKEND_HPP
+
+#include "inference_backend.hpp"
+#include "embd_cache.hpp"
+#include "clip_cache.hpp"
+
+#include "llama.cpp/examples/llava/clip.h"
+#include "llama.cpp/common/common.h"
+#include "llama.cpp/llama.h"
+
+struct llava_backend_options
+{
+    int n_threads_clip = -1;        // CLIP encode threads, or -1 for params.n_threads
+    int numa_node = -1;             // if not -1, the CLIP context is only shared on this node
+    bool huge_page_weights = false; // advise huge pages for weights loaded into memory
+    std::string mmproj_quant;       // if not empty, the mmproj is quantized to this type when loaded
+    std::string mmproj_cache_dir = "mmproj-cache";  // where quantized mmproj files are kept
+};
+
+class llava_backend : public inference_backend
+{
+public:
+    llava_backend(const gpt_params &params, const llava_backend_options &options = llava_backend_options());
+    ~llava_backend() override;
+
+    // Loads the CLIP and LLaMA models and creates the context reused by all requests
+    bool load();
+
+    // Looks up the image in the embedding cache, or decodes and preprocesses it
+    std::unique_ptr<prepared_input> prepare(const llava_request &request, httplib::Response &web_response, inference_timings &timings) override;
+
+    void perform_inference(
+        const llava_request &request,
+        prepared_input &input,
+        httplib::Response &web_response,
+        int64_t t_hand_off_us,
+        inference_timings &timings
+    ) override;
+
+    // Writes the system prompt prefix KV (<prefix>.kv), the embedding cache (<prefix>.embd), and
+    // the identity of the files they were computed with (<prefix>.meta)
+    bool save_snapshot(const std::string &path_prefix) override;
+    void load_snapshot(const std::string &path_prefix) override;
+
+    int64_t context_bytes() const override;
+
+private:
+    // Encodes a preprocessed image into m_image_embd
+    bool encode_image(clip_image_f32 &image, httplib::Response &web_response, inference_timings &timings);
+
+    // Identifies the files (and context size) that KV and embedding snapshots depend on
+    std::string model_identity() const;
+    std::string mmproj_identity() const;
+
+    // Updates this instance's share of the KV cache bytes reported as used
+    void set_kv_used(int64_t bytes);
+
+    gpt_params m_params;
+    llava_backend_options m_options;
+    std::string m_mmproj_path;                  // mmproj file loaded, which may be a quantized copy
+    std::shared_ptr<shared_clip_ctx> m_clip;    // shared with other backends using the same mmproj
+    llama_model *m_model = nullptr;
+    llama_context *m_ctx_llama = nullptr;
+    embd_vector m_image_embd;               // reused across requests
+    embd_cache m_embd_cache;
+    std::vector<llama_token> m_prefix_tokens;   // system prompt prefix currently at the start of the KV cache
+
+    // Memory accounted to this instance, released on destruction
+    int64_t m_model_bytes = 0;
+    int64_t m_kv_bytes = 0;
+    int64_t m_kv_used_bytes = 0;                // part of the KV cache holding tokens
+    int64_t m_compute_bytes = 0;                // estimated, as llama.cpp does not report it
+    int m_slot_id = -1;                         // registered with memory_add_slot()
+};
+
+#endif  // INCLUDED_LLAVA_BACKEND_HPP
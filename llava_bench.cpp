@@ -0,0 +1,651 @@
+/*
+ * llava_bench.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Load generator for llava-server. Replays a JSONL corpus of requests against a running server,
+ * either open-loop (requests issued at a fixed rate regardless of completions) or closed-loop (a
+ * fixed number of clients, each issuing its next request when the previous one completes), and
+ * reports throughput and latency percentiles.
+ *
+ * Each corpus line is an object of the form:
+ *
+ *      {"image": "images/cat.jpg", "user_prompt": "what is this?", "system_prompt": "...", "params": {...}}
+ *
+ * Image paths are relative to the corpus file. system_prompt and params are optional; each entry
+ * in params is sent as an additional form field.
+ *
+ * The server does not stream, so time to first token and inter-token latency are taken from the
+ * timings object it returns, while end-to-end latency is measured here.
+ *
+ * Sample usage:
+ *
+ *      bin/llava-bench --corpus corpus.jsonl --concurrency 4 --requests 200 --output results.json
+ *      bin/llava-bench --corpus corpus.jsonl --rate 0.5 --poisson --duration 300
+ */
+
+#include "cpp-httplib/httplib.h"
+#include "llama.cpp/examples/server/json.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+using json = nlohmann::json;
+using bench_clock = std::chrono::steady_clock;
+
+struct corpus_entry
+{
+    std::string image_path;
+    std::shared_ptr<std::string> image;
+    std::string user_prompt;
+    std::string system_prompt;
+    std::vector<std::pair<std::string, std::string>> params;
+};
+
+struct bench_options
+{
+    std::string corpus_file;
+    std::string host = "localhost";
+    int port = 8080;
+    double rate = 0;            // requests/s; > 0 selects open-loop mode
+    bool poisson = false;       // exponential inter-arrival times in open-loop mode
+    int max_inflight = 256;     // open-loop requests in flight at once; arrivals beyond it are not issued
+    int concurrency = 1;        // clients in closed-loop mode
+    int num_requests = 0;       // 0 = one pass over the corpus (unless a duration is given)
+    double duration_s = 0;
+    int timeout_s = 600;
+    std::string output_file;
+    std::string label;
+};
+
+struct request_result
+{
+    size_t corpus_index = 0;
+    double start_s = 0;         // relative to start of benchmark
+    double e2e_ms = 0;
+    double ttft_ms = 0;
+    double itl_ms = 0;
+    double queue_wait_ms = 0;
+    int generated_tokens = 0;
+    bool error = false;
+    std::string description;
+};
+
+static bool read_file(const std::string &path, std::string &contents)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+    contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+static std::string directory_of(const std::string &path)
+{
+    size_t pos = path.find_last_of('/');
+    return pos == std::string::npos ? "" : path.substr(0, pos + 1);
+}
+
+static bool load_corpus(const std::string &filename, std::vector<corpus_entry> &corpus)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+        fprintf(stderr, "error: unable to open corpus %s\n", filename.c_str());
+        return false;
+    }
+
+    const std::string base_dir = directory_of(filename);
+    std::map<std::string, std::shared_ptr<std::string>> images;
+
+    // A bad line is skipped rather than ending the run, since corpora are often captured traffic
+    std::string line;
+    int line_number = 0;
+    int skipped = 0;
+    while (std::getline(file, line))
+    {
+        line_number++;
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+        {
+            continue;
+        }
+
+        json j = json::parse(line, nullptr, false);
+        auto is_string = [&j](const char *key) { return j.contains(key) && j[key].is_string(); };
+        if (j.is_discarded() || !j.is_object() || !is_string("image") || !is_string("user_prompt") ||
+            (j.contains("system_prompt") && !is_string("system_prompt")))
+        {
+            fprintf(stderr, "warning: %s:%d: expected an object with image and user_prompt strings, skipping\n", filename.c_str(), line_number);
+            skipped++;
+            continue;
+        }
+
+        corpus_entry entry;
+        entry.image_path = j["image"].get<std::string>();
+        entry.user_prompt = j["user_prompt"].get<std::string>();
+        entry.system_prompt = j.value("system_prompt", "");
+        if (j.contains("params") && j["params"].is_object())
+        {
+            for (auto &item : j["params"].items())
+            {
+                entry.params.emplace_back(item.key(), item.value().is_string() ? item.value().get<std::string>() : item.value().dump());
+            }
+        }
+
+        std::string path = !entry.image_path.empty() && entry.image_path[0] == '/' ? entry.image_path : base_dir + entry.image_path;
+        auto it = images.find(path);
+        if (it == images.end())
+        {
+            auto image = std::make_shared<std::string>();
+            if (!read_file(path, *image))
+            {
+                fprintf(stderr, "warning: %s:%d: unable to read image %s, skipping\n", filename.c_str(), line_number, path.c_str());
+                skipped++;
+                continue;
+            }
+            it = images.emplace(path, image).first;
+        }
+        entry.image = it->second;
+
+        corpus.emplace_back(std::move(entry));
+    }
+
+    if (skipped > 0)
+    {
+        fprintf(stderr, "warning: skipped %d of %d corpus lines\n", skipped, skipped + int(corpus.size()));
+    }
+    if (corpus.empty())
+    {
+        fprintf(stderr, "error: corpus %s is empty\n", filename.c_str());
+        return false;
+    }
+    return true;
+}
+
+static request_result send_request(const bench_options &options, const corpus_entry &entry)
+{
+    request_result result;
+
+    httplib::MultipartFormDataItems items =
+    {
+        { "user_prompt", entry.user_prompt, "", "" },
+        { "image_file", *entry.image, entry.image_path, "application/octet-stream" }
+    };
+    if (!entry.system_prompt.empty())
+    {
+        items.push_back({ "system_prompt", entry.system_prompt, "", "" });
+    }
+    for (auto &param : entry.params)
+    {
+        items.push_back({ param.first, param.second, "", "" });
+    }
+
+    httplib::Client cli(options.host, options.port);
+    cli.set_read_timeout(options.timeout_s);
+    cli.set_write_timeout(options.timeout_s);
+
+    auto t_start = bench_clock::now();
+    auto res = cli.Post("/llava", items);
+    result.e2e_ms = std::chrono::duration<double, std::milli>(bench_clock::now() - t_start).count();
+
+    if (!res)
+    {
+        result.error = true;
+        result.description = httplib::to_string(res.error());
+        return result;
+    }
+
+    json j = json::parse(res->body, nullptr, false);
+    if (res->status != 200 || j.is_discarded() || !j.is_object())
+    {
+        result.error = true;
+        result.description = "HTTP " + std::to_string(res->status);
+        return result;
+    }
+    if (j.value("error", true))
+    {
+        result.error = true;
+        result.description = j.value("description", "unknown error");
+        return result;
+    }
+
+    if (j.contains("timings"))
+    {
+        const json &timings = j["timings"];
+        result.ttft_ms = timings.value("time_to_first_token_ms", 0.0);
+        result.queue_wait_ms = timings.value("queue_wait_ms", 0.0);
+        result.generated_tokens = timings.value("generated_tokens", 0);
+        if (result.generated_tokens > 1)
+        {
+            // The n - 1 intervals between the first and last tokens returned, which leaves out
+            // sampling the end-of-sequence token
+            const double last_token_ms = timings.value("time_to_last_token_ms", 0.0);
+            result.itl_ms = std::max(0.0, (last_token_ms - result.ttft_ms) / (result.generated_tokens - 1));
+        }
+    }
+
+    return result;
+}
+
+struct distribution
+{
+    size_t n = 0;
+    double mean = 0;
+    double p50 = 0;
+    double p90 = 0;
+    double p99 = 0;
+    double max = 0;
+};
+
+static double percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    // Nearest-rank
+    size_t rank = size_t(std::ceil(p / 100.0 * sorted.size()));
+    return sorted[std::min(std::max(rank, size_t(1)), sorted.size()) - 1];
+}
+
+static distribution summarize(std::vector<double> values)
+{
+    distribution d;
+    if (values.empty())
+    {
+        return d;
+    }
+    std::sort(values.begin(), values.end());
+    d.n = values.size();
+    for (double v : values)
+    {
+        d.mean += v;
+    }
+    d.mean /= values.size();
+    d.p50 = percentile(values, 50);
+    d.p90 = percentile(values, 90);
+    d.p99 = percentile(values, 99);
+    d.max = values.back();
+    return d;
+}
+
+static json to_json(const distribution &d)
+{
+    return json { { "n", d.n }, { "mean", d.mean }, { "p50", d.p50 }, { "p90", d.p90 }, { "p99", d.p99 }, { "max", d.max } };
+}
+
+static void print_distribution(const char *name, const distribution &d)
+{
+    printf("  %-22s mean %9.2f  p50 %9.2f  p90 %9.2f  p99 %9.2f  max %9.2f ms\n", name, d.mean, d.p50, d.p90, d.p99, d.max);
+}
+
+static std::vector<request_result> run_benchmark(const bench_options &options, const std::vector<corpus_entry> &corpus, double &wall_s, size_t &not_issued)
+{
+    not_issued = 0;
+    const size_t max_requests = options.num_requests > 0 ? size_t(options.num_requests) : (options.duration_s > 0 ? SIZE_MAX : corpus.size());
+    const auto t_start = bench_clock::now();
+    const auto t_deadline = options.duration_s > 0 ? t_start + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(options.duration_s)) : bench_clock::time_point::max();
+
+    std::mutex results_mutex;
+    std::vector<request_result> results;
+
+    auto issue = [&](size_t i)
+    {
+        const double start_s = std::chrono::duration<double>(bench_clock::now() - t_start).count();
+        request_result result = send_request(options, corpus[i % corpus.size()]);
+        result.corpus_index = i % corpus.size();
+        result.start_s = start_s;
+        std::lock_guard<std::mutex> lock(results_mutex);
+        results.emplace_back(std::move(result));
+    };
+
+    std::vector<std::thread> threads;
+
+    if (options.rate > 0)
+    {
+        // Open loop: a pool of max_inflight threads issues requests, so that slow responses do not
+        // delay arrivals. Arrivals that find every thread busy are counted as not issued, rather
+        // than queued, which would turn the open loop into a closed one.
+        std::mutex pool_mutex;
+        std::condition_variable pool_cv;
+        std::deque<size_t> arrivals;
+        int in_flight = 0;
+        bool done = false;
+        for (int t = 0; t < options.max_inflight; t++)
+        {
+            threads.emplace_back([&]()
+            {
+                std::unique_lock<std::mutex> lock(pool_mutex);
+                while (true)
+                {
+                    pool_cv.wait(lock, [&]() { return done || !arrivals.empty(); });
+                    if (arrivals.empty())
+                    {
+                        return;
+                    }
+                    const size_t i = arrivals.front();
+                    arrivals.pop_front();
+                    lock.unlock();
+                    issue(i);
+                    lock.lock();
+                    in_flight--;
+                }
+            });
+        }
+
+        std::mt19937_64 rng(1234);
+        std::exponential_distribution<double> exponential(options.rate);
+        double t_next_s = 0;
+        for (size_t i = 0; i < max_requests; i++)
+        {
+            auto t_next = t_start + std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(t_next_s));
+            if (t_next >= t_deadline)
+            {
+                break;
+            }
+            std::this_thread::sleep_until(t_next);
+            {
+                std::lock_guard<std::mutex> lock(pool_mutex);
+                if (in_flight >= options.max_inflight)
+                {
+                    not_issued++;
+                }
+                else
+                {
+                    in_flight++;
+                    arrivals.push_back(i);
+                    pool_cv.notify_one();
+                }
+            }
+            t_next_s += options.poisson ? exponential(rng) : 1.0 / options.rate;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(pool_mutex);
+            done = true;
+        }
+        pool_cv.notify_all();
+    }
+    else
+    {
+        // Closed loop: each client issues its next request as soon as the previous one completes
+        std::atomic<size_t> next(0);
+        for (int c = 0; c < options.concurrency; c++)
+        {
+            threads.emplace_back([&]()
+            {
+                while (bench_clock::now() < t_deadline)
+                {
+                    size_t i = next.fetch_add(1);
+                    if (i >= max_requests)
+                    {
+                        break;
+                    }
+                    issue(i);
+                }
+            });
+        }
+        for (auto &thread : threads)
+        {
+            thread.join();
+        }
+        threads.clear();
+    }
+
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+
+    wall_s = std::chrono::duration<double>(bench_clock::now() - t_start).count();
+    std::sort(results.begin(), results.end(), [](const request_result &a, const request_result &b) { return a.start_s < b.start_s; });
+    return results;
+}
+
+static void report(const bench_options &options, const std::vector<request_result> &results, double wall_s, size_t not_issued)
+{
+    std::vector<double> e2e, ttft, itl, queue_wait;
+    size_t errors = 0;
+    uint64_t tokens = 0;
+    for (const request_result &result : results)
+    {
+        if (result.error)
+        {
+            errors++;
+            continue;
+        }
+        e2e.push_back(result.e2e_ms);
+        ttft.push_back(result.ttft_ms);
+        queue_wait.push_back(result.queue_wait_ms);
+        if (result.generated_tokens > 1)
+        {
+            itl.push_back(result.itl_ms);
+        }
+        tokens += result.generated_tokens;
+    }
+
+    const size_t succeeded = results.size() - errors;
+    const double throughput_rps = wall_s > 0 ? succeeded / wall_s : 0;
+    const double throughput_tps = wall_s > 0 ? tokens / wall_s : 0;
+    distribution e2e_d = summarize(e2e);
+    distribution ttft_d = summarize(ttft);
+    distribution itl_d = summarize(itl);
+    distribution queue_wait_d = summarize(queue_wait);
+
+    printf("\n");
+    if (options.rate > 0)
+    {
+        printf("mode: open-loop, %.3f requests/s%s\n", options.rate, options.poisson ? " (poisson)" : "");
+    }
+    else
+    {
+        printf("mode: closed-loop, concurrency %d\n", options.concurrency);
+    }
+    printf("requests: %zu (%zu errors) in %.2f s\n", results.size(), errors, wall_s);
+    if (not_issued > 0)
+    {
+        printf("not issued: %zu arrivals found %d requests already in flight (--max-inflight)\n", not_issued, options.max_inflight);
+    }
+    printf("throughput: %.3f requests/s, %.2f tokens/s\n", throughput_rps, throughput_tps);
+    print_distribution("end-to-end latency", e2e_d);
+    print_distribution("time to first token", ttft_d);
+    print_distribution("inter-token latency", itl_d);
+    print_distribution("queue wait", queue_wait_d);
+
+    if (options.output_file.empty())
+    {
+        return;
+    }
+
+    json per_request = json::array();
+    for (const request_result &result : results)
+    {
+        json r =
+        {
+            { "corpus_index", result.corpus_index },
+            { "start_s", result.start_s },
+            { "e2e_ms", result.e2e_ms },
+            { "error", result.error }
+        };
+        if (result.error)
+        {
+            r["description"] = result.description;
+        }
+        else
+        {
+            r["ttft_ms"] = result.ttft_ms;
+            r["itl_ms"] = result.itl_ms;
+            r["queue_wait_ms"] = result.queue_wait_ms;
+            r["generated_tokens"] = result.generated_tokens;
+        }
+        per_request.push_back(r);
+    }
+
+    json out =
+    {
+        { "label", options.label },
+        { "corpus", options.corpus_file },
+        { "mode", options.rate > 0 ? "open-loop" : "closed-loop" },
+        { "rate", options.rate },
+        { "poisson", options.poisson },
+        { "concurrency", options.concurrency },
+        { "requests", results.size() },
+        { "errors", errors },
+        { "not_issued", not_issued },
+        { "duration_s", wall_s },
+        { "throughput_rps", throughput_rps },
+        { "throughput_tokens_per_s", throughput_tps },
+        { "e2e_ms", to_json(e2e_d) },
+        { "ttft_ms", to_json(ttft_d) },
+        { "itl_ms", to_json(itl_d) },
+        { "queue_wait_ms", to_json(queue_wait_d) },
+        { "per_request", per_request }
+    };
+
+    std::ofstream file(options.output_file);
+    if (!file)
+    {
+        fprintf(stderr, "error: unable to write %s\n", options.output_file.c_str());
+        return;
+    }
+    file << out.dump(2) << std::endl;
+    printf("\nresults written to %s\n", options.output_file.c_str());
+}
+
+static void print_usage(const char *argv0)
+{
+    printf("usage: %s --corpus FNAME [options]\n", argv0);
+    printf("\n");
+    printf("options:\n");
+    printf("  --corpus FNAME        JSONL corpus of requests to replay (required)\n");
+    printf("  --host HOST           server host (default: localhost)\n");
+    printf("  --port PORT           server port (default: 8080)\n");
+    printf("  --rate R              open-loop mode: issue R requests/s\n");
+    printf("  --poisson             open-loop mode: exponentially distributed inter-arrival times\n");
+    printf("  --max-inflight N      open-loop mode: requests in flight at once; arrivals beyond this are not\n");
+    printf("                        issued, and are counted (default: 256)\n");
+    printf("  --concurrency N       closed-loop mode: N concurrent clients (default: 1)\n");
+    printf("  --requests N          number of requests to issue (default: one pass over the corpus)\n");
+    printf("  --duration S          stop issuing requests after S seconds\n");
+    printf("  --timeout S           per-request timeout in seconds (default: 600)\n");
+    printf("  --output FNAME        write results as JSON to FNAME\n");
+    printf("  --label NAME          label recorded in the JSON results (e.g., build or config)\n");
+}
+
+static bool parse_command_line(int argc, char **argv, bench_options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const char *arg = argv[i];
+        if (!strcmp(arg, "--poisson"))
+        {
+            options.poisson = true;
+            continue;
+        }
+        if (!strcmp(arg, "-h") || !strcmp(arg, "--help"))
+        {
+            return false;
+        }
+        if (i + 1 >= argc)
+        {
+            fprintf(stderr, "error: %s requires one argument.\n", arg);
+            return false;
+        }
+        const char *value = argv[++i];
+        if (!strcmp(arg, "--corpus"))
+        {
+            options.corpus_file = value;
+        }
+        else if (!strcmp(arg, "--host"))
+        {
+            options.host = value;
+        }
+        else if (!strcmp(arg, "--port"))
+        {
+            options.port = std::stoi(value);
+        }
+        else if (!strcmp(arg, "--rate"))
+        {
+            options.rate = std::stod(value);
+        }
+        else if (!strcmp(arg, "--max-inflight"))
+        {
+            options.max_inflight = std::max(1, std::stoi(value));
+        }
+        else if (!strcmp(arg, "--concurrency"))
+        {
+            options.concurrency = std::max(1, std::stoi(value));
+        }
+        else if (!strcmp(arg, "--requests"))
+        {
+            options.num_requests = std::stoi(value);
+        }
+        else if (!strcmp(arg, "--duration"))
+        {
+            options.duration_s = std::stod(value);
+        }
+        else if (!strcmp(arg, "--timeout"))
+        {
+            options.timeout_s = std::stoi(value);
+        }
+        else if (!strcmp(arg, "--output"))
+        {
+            options.output_file = value;
+        }
+        else if (!strcmp(arg, "--label"))
+        {
+            options.label = value;
+        }
+        else
+        {
+            fprintf(stderr, "error: unknown argument: %s\n", arg);
+            return false;
+        }
+    }
+
+    if (options.corpus_file.empty())
+    {
+        fprintf(stderr, "error: --corpus is required\n");
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bench_options options;
+    if (!parse_command_line(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    std::vector<corpus_entry> corpus;
+    if (!load_corpus(options.corpus_file, corpus))
+    {
+        return 1;
+    }
+    printf("loaded %zu requests from %s\n", corpus.size(), options.corpus_file.c_str());
+
+    double wall_s = 0;
+    size_t not_issued = 0;
+    std::vector<request_result> results = run_benchmark(options, corpus, wall_s, not_issued);
+    report(options, results, wall_s, not_issued);
+
+    return 0;
+}
@@ -0,0 +1,126 @@
+/*
+ * llava_eval.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Evaluation helpers. Inputs are split into n_batch-sized chunks here and each chunk is handed to
+ * the corresponding llava-utils.h helper, which then issues exactly one llama_decode() call. This
+ * keeps the behavior of llava-utils.h while letting us see each batch in the trace and in the
+ * slow request log.
+ */
+
+#include "llava_eval.hpp"
+#include "trace.hpp"
+#include "slow_log.hpp"
+
+#include "llama.cpp/examples/llava/llava-utils.h"
+
+#include <algorithm>
+
+static std::string batch_args(const char *kind, int n_tokens, int n_past)
+{
+    return std::string("{\"kind\": \"") + kind + "\", \"n_tokens\": " + std::to_string(n_tokens) + ", \"n_past\": " + std::to_string(n_past) + "}";
+}
+
+// Records a llama_decode call covering its own lifetime in the trace and the slow request log
+class decode_scope
+{
+public:
+    decode_scope(const char *kind, int n_tokens, int n_past)
+        : m_kind(kind),
+          m_n_tokens(n_tokens),
+          m_n_past(n_past),
+          m_start_us(trace_enabled() || slow_log_enabled() ? trace_now_us() : 0)
+    {
+    }
+
+    ~decode_scope()
+    {
+        if (m_start_us == 0)
+        {
+            return;
+        }
+        const int64_t duration_us = trace_now_us() - m_start_us;
+        if (trace_enabled())
+        {
+            trace_span("llama_decode", "llm", m_start_us, duration_us, batch_args(m_kind, m_n_tokens, m_n_past));
+        }
+        slow_log_decode(m_kind, m_n_tokens, m_n_past, m_start_us, duration_us);
+    }
+
+private:
+    const char *m_kind;
+    int m_n_tokens;
+    int m_n_past;
+    int64_t m_start_us;
+};
+
+bool llava_eval_tokens(llama_context *ctx_llama, const std::vector<llama_token> &tokens, int n_batch, int *n_past)
+{
+    for (size_t i = 0; i < tokens.size(); i += n_batch)
+    {
+        const size_t n_eval = std::min(tokens.size() - i, size_t(n_batch));
+        std::vector<llama_token> batch(tokens.begin() + i, tokens.begin() + i + n_eval);
+
+        decode_scope decode("text", int(n_eval), *n_past);
+        if (!eval_tokens(ctx_llama, batch, n_batch, n_past))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool llava_eval_string(llama_context *ctx_llama, const std::string &str, int n_batch, int *n_past)
+{
+    std::vector<llama_token> tokens = ::llama_tokenize(ctx_llama, str, true);
+    return llava_eval_tokens(ctx_llama, tokens, n_batch, n_past);
+}
+
+bool llava_eval_image_embd(llama_context *ctx_llama, const float *image_embd, int n_image_pos, int n_batch, int *n_past)
+{
+    const int n_embd = llama_n_embd(llama_get_model(ctx_llama));
+    for (int i = 0; i < n_image_pos; i += n_batch)
+    {
+        const int n_eval = std::min(n_image_pos - i, n_batch);
+
+        decode_scope decode("image", n_eval, *n_past);
+        // eval_image_embd() does not modify the embeddings despite taking a non-const pointer
+        if (!eval_image_embd(ctx_llama, const_cast<float *>(image_embd) + size_t(i) * n_embd, n_eval, n_batch, n_past))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+int llava_shift_context(llama_context *ctx_llama, int n_keep, int *n_past)
+{
+    const int n_discard = (*n_past - n_keep) / 2;
+    if (n_discard <= 0)
+    {
+        return 0;
+    }
+
+    const int64_t t_start_us = trace_enabled() ? trace_now_us() : 0;
+    llama_kv_cache_seq_rm(ctx_llama, 0, n_keep, n_keep + n_discard);
+    llama_kv_cache_seq_shift(ctx_llama, 0, n_keep + n_discard, *n_past, -n_discard);
+    *n_past -= n_discard;
+    if (trace_enabled())
+    {
+        trace_span("context_shift", "llm", t_start_us, trace_now_us() - t_start_us,
+            "{\"n_keep\": " + std::to_string(n_keep) + ", \"n_discard\": " + std::to_string(n_discard) + "}");
+    }
+    return n_discard;
+}
+
+std::string llava_sample(llama_context *ctx_llama, gpt_params &params, int *n_past)
+{
+    llama_token id = sample_id(ctx_llama, params);
+
+    std::string piece = id == llama_token_eos(ctx_llama) ? "</s>" : llama_token_to_piece(ctx_llama, id);
+
+    decode_scope decode("token", 1, *n_past);
+    eval_id(ctx_llama, id, n_past);
+
+    return piece;
+}
@@ -0,0 +1,31 @@
+/*
+ * llava_eval.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Evaluation helpers equivalent to those in llama.cpp/examples/llava/llava-utils.h, except that
+ * every llama_decode() call is visible to us (one call per batch), so it can be traced.
+ */
+
+#pragma once
+#ifndef INCLUDED_LLAVA_EVAL_HPP
+#define INCLUDED_LLAVA_EVAL_HPP
+
+#include "llama.cpp/common/common.h"
+#include "llama.cpp/llama.h"
+
+#include <string>
+#include <vector>
+
+bool llava_eval_tokens(llama_context *ctx_llama, const std::vector<llama_token> &tokens, int n_batch, int *n_past);
+bool llava_eval_string(llama_context *ctx_llama, const std::string &str, int n_batch, int *n_past);
+bool llava_eval_image_embd(llama_context *ctx_llama, const float *image_embd, int n_image_pos, int n_batch, int *n_past);
+
+// Makes room in a full context by discarding the older half of the tokens after the first n_keep,
+// then shifting the positions of the rest down in place, so that nothing is evaluated again.
+// Returns the number of tokens discarded.
+int llava_shift_context(llama_context *ctx_llama, int n_keep, int *n_past);
+
+// Samples the next token and evaluates it. Returns "</s>" at end of stream.
+std::string llava_sample(llama_context *ctx_llama, gpt_params &params, int *n_past);
+
+#endif  // INCLUDED_LLAVA_EVAL_HPP
@@ -0,0 +1,105 @@
+/*
+ * llava_image.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Image decoding for CLIP, plus synthetic images for benchmarking.
+ */
+
+#include "llava_image.hpp"
+
+#include "llama.cpp/common/stb_image.h"
+
+#include <cstdio>
+#include <cstring>
+
+bool clip_image_load_from_memory(const uint8_t *image_buffer, size_t image_buffer_size, clip_image_u8 *img)
+{
+    int nx, ny, nc;
+    auto data = stbi_load_from_memory(image_buffer, image_buffer_size, &nx, &ny, &nc, 3);
+    if (!data) 
+    {
+        fprintf(stderr, "%s: failed to load image\n", __func__);
+        return false;
+    }
+
+    img->nx = nx;
+    img->ny = ny;
+    img->size = nx * ny * 3;
+    img->data = new uint8_t[img->size]();
+    memcpy(img->data, data, img->size);
+
+    stbi_image_free(data);
+
+    return true;
+}
+
+void free_image_data(clip_image_u8 *img)
+{
+    delete [] img->data;
+    img->data = nullptr;
+    img->size = 0;
+}
+
+void free_image_data(clip_image_f32 *img)
+{
+    delete [] img->data;
+    img->data = nullptr;
+    img->size = 0;
+}
+
+static void put_le(std::vector<uint8_t> &out, uint32_t value, int num_bytes)
+{
+    for (int i = 0; i < num_bytes; i++)
+    {
+        out.push_back(uint8_t(value >> (8 * i)));
+    }
+}
+
+std::vector<uint8_t> make_synthetic_bmp(int nx, int ny)
+{
+    const uint32_t row_bytes = (uint32_t(nx) * 3 + 3) & ~3u;    // rows are padded to 4 bytes
+    const uint32_t pixel_bytes = row_bytes * uint32_t(ny);
+
+    std::vector<uint8_t> bmp;
+    bmp.reserve(54 + pixel_bytes);
+
+    // BITMAPFILEHEADER
+    bmp.push_back('B');
+    bmp.push_back('M');
+    put_le(bmp, 54 + pixel_bytes, 4);
+    put_le(bmp, 0, 4);
+    put_le(bmp, 54, 4);
+
+    // BITMAPINFOHEADER
+    put_le(bmp, 40, 4);
+    put_le(bmp, uint32_t(nx), 4);
+    put_le(bmp, uint32_t(ny), 4);
+    put_le(bmp, 1, 2);      // planes
+    put_le(bmp, 24, 2);     // bits per pixel
+    put_le(bmp, 0, 4);      // BI_RGB
+    put_le(bmp, pixel_bytes, 4);
+    put_le(bmp, 2835, 4);   // 72 DPI
+    put_le(bmp, 2835, 4);
+    put_le(bmp, 0, 4);
+    put_le(bmp, 0, 4);
+
+    // Gradients with a checkerboard, so the image is not trivially compressible or uniform
+    for (int y = 0; y < ny; y++)
+    {
+        uint32_t written = 0;
+        for (int x = 0; x < nx; x++)
+        {
+            const uint8_t checker = ((x / 32) + (y / 32)) % 2 ? 64 : 0;
+            bmp.push_back(uint8_t((x * 255) / (nx > 1 ? nx - 1 : 1)) ^ checker);   // B
+            bmp.push_back(uint8_t((y * 255) / (ny > 1 ? ny - 1 : 1)));             // G
+            bmp.push_back(uint8_t(((x + y) * 127) / (nx + ny)) ^ checker);          // R
+            written += 3;
+        }
+        for (; written < row_bytes; written++)
+        {
+            bmp.push_back(0);
+        }
+    }
+
+    return bmp;
+}
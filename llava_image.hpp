@@ -0,0 +1,27 @@
+/*
+ * llava_image.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Image decoding for CLIP, plus synthetic images for benchmarking.
+ */
+
+#pragma once
+#ifndef INCLUDED_LLAVA_IMAGE_HPP
+#define INCLUDED_LLAVA_IMAGE_HPP
+
+#include "llama.cpp/examples/llava/clip.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+bool clip_image_load_from_memory(const uint8_t *image_buffer, size_t image_buffer_size, clip_image_u8 *img);
+
+// Releases pixel data allocated by clip_image_load_from_memory() and clip_image_preprocess()
+void free_image_data(clip_image_u8 *img);
+void free_image_data(clip_image_f32 *img);
+
+// Encodes a deterministic nx x ny test pattern as an uncompressed 24-bit BMP
+std::vector<uint8_t> make_synthetic_bmp(int nx, int ny);
+
+#endif  // INCLUDED_LLAVA_IMAGE_HPP
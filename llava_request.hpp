@@ -14,10 +14,13 @@
 
 struct llava_request
 {
+    std::string model = "default";
     std::string system_prompt = "A chat between a curious human and an artificial intelligence assistant.  The assistant gives helpful, detailed, and polite answers to the human's questions.";
     std::string user_prompt;
     std::shared_ptr<uint8_t[]> image;
     size_t image_buffer_size;
+    int n_predict = -1;         // maximum number of tokens to generate, or -1 for the server default
+    bool warmup = false;        // synthetic request, whose image embedding is not cached
 };
 
 #endif  // INCLUDED_LLAVA_REQUEST_HPP
\ No newline at end of file
@@ -14,147 +14,89 @@
  */
 
 #include "web_server.hpp"
+#include "metrics.hpp"
+#include "inference_timings.hpp"
+#include "trace.hpp"
+#include "slow_log.hpp"
+#include "server_status.hpp"
+#include "memory_accounting.hpp"
+#include "inference_backend.hpp"
+#include "llava_backend.hpp"
+#include "mock_backend.hpp"
+#include "backend_slot.hpp"
+#include "model_registry.hpp"
+#include "stage_threads.hpp"
+#include "numa.hpp"
+#include "cpu_limits.hpp"
+#include "autotune.hpp"
+#include "capture.hpp"
+#include "huge_pages.hpp"
+#include "mmproj_quant.hpp"
+#include "replica_backend.hpp"
 
-#include "llama.cpp/examples/llava/clip.h"
-#include "llama.cpp/examples/llava/llava-utils.h"
 #include "llama.cpp/common/common.h"
 #include "llama.cpp/llama.h"
-#include "llama.cpp/common/stb_image.h"
 
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <queue>
 #include <thread>
 #include <tuple>
 #include <vector>
 
-static bool clip_image_load_from_memory(std::shared_ptr<uint8_t[]> image_buffer, size_t image_buffer_size, clip_image_u8 *img)
-{
-    int nx, ny, nc;
-    auto data = stbi_load_from_memory(image_buffer.get(), image_buffer_size, &nx, &ny, &nc, 3);
-    if (!data) 
-    {
-        fprintf(stderr, "%s: failed to load image\n", __func__);
-        return false;
-    }
-
-    img->nx = nx;
-    img->ny = ny;
-    img->size = nx * ny * 3;
-    img->data = new uint8_t[img->size]();
-    memcpy(img->data, data, img->size);
+// How long requests cut short at the drain deadline are given to return
+static constexpr std::chrono::seconds k_drain_grace(10);
 
-    stbi_image_free(data);
+// Set once the web server has stopped and all requests have finished (the shutdown watchdog may
+// outlive main())
+static std::atomic<bool> s_drained(false);
 
-    return true;
-}
-
-static void perform_inference(
-    const llava_request &request,
-    httplib::Response &web_response,
-    gpt_params &params,
-    clip_ctx *ctx_clip,
-    llama_context *ctx_llama
-)
+struct server_options
 {
-    std::cout << "Processing request:" << std::endl
-              << "  System prompt: " << request.system_prompt << std::endl
-              << "  User prompt  : " << request.user_prompt << std::endl
-              << "  Image        : " << request.image_buffer_size << " bytes" << std::endl
-              << std::endl;
-
-    // load and preprocess the image
-    clip_image_u8 img;
-    clip_image_f32 img_res;
-
-    if (!clip_image_load_from_memory(request.image, request.image_buffer_size, &img))
-    {
-        web_response.set_content("{\"error\": true, \"description\": \"unable to load image\"}", "application/json");
-        return;
-    }
-
-    if (!clip_image_preprocess(ctx_clip, &img, &img_res, /*pad2square =*/ true))
-    {
-        fprintf(stderr, "%s: unable to preprocess image\n", __func__);
-        web_response.set_content("{\"error\": true, \"description\": \"unable to preprocess image\"}", "application/json");
-        return;
-    }
-
-    int n_img_pos  = clip_n_patches(ctx_clip);
-    int n_img_embd = clip_n_mmproj_embd(ctx_clip);
-
-    float *image_embd = (float *) malloc(clip_embd_nbytes(ctx_clip));
-
-    if (!image_embd) 
-    {
-        fprintf(stderr, "Unable to allocate memory for image embeddings\n");
-        web_response.set_content("{\"error\": true, \"description\": \"unable to allocate memory for image embeddings\"}", "application/json");
-        return;
-    }
-
-    const int64_t t_img_enc_start_us = ggml_time_us();
-    if (!clip_image_encode(ctx_clip, params.n_threads, &img_res, image_embd))
-    {
-        fprintf(stderr, "Unable to encode image\n");
-        web_response.set_content("{\"error\": true, \"description\": \"unable to encode image\"}", "application/json");
-        return;
-    }
-    const int64_t t_img_enc_end_us = ggml_time_us();
-
-    // make sure that the correct mmproj was used, i.e., compare apples to apples
-    int n_llama_embd = llama_n_embd(llama_get_model(ctx_llama));
-    if (n_img_embd != n_llama_embd)
-    {
-        printf("%s: embedding dim of the multimodal projector (%d) is not equal to that of LLaMA (%d). Make sure that you use the correct mmproj file.\n", __func__, n_img_embd, n_llama_embd);
-        web_response.set_content("{\"error\": true, \"description\": \"multimodal projector embedding dimensions are not equal to LLaMA, which may indicate the wrong mmproj file is being used\"}", "application/json");
-        free(image_embd);
-        return;
-    }
-
-    // process the prompt
-    // llava chat format is "<system_prompt>USER: <image_embeddings>\n<textual_prompt>\nASSISTANT:"
-
-    int n_past = 0;
-
-    const int max_tgt_len = params.n_predict < 0 ? 256 : params.n_predict;
-
-    // Clear state
-    llama_kv_cache_tokens_rm(ctx_llama, -1, -1);
-
-    // GG: are we sure that the should be a trailing whitespace at the end of this string?
-    std::string prompt = request.system_prompt + "\nUSER: ";
-    eval_string(ctx_llama, prompt.c_str(), params.n_batch, &n_past);
-    eval_image_embd(ctx_llama, image_embd, n_img_pos, params.n_batch, &n_past);
-    eval_string(ctx_llama, request.user_prompt.c_str(), params.n_batch, &n_past);
-    eval_string(ctx_llama, "\nASSISTANT:",        params.n_batch, &n_past);
-
-    // generate the response
-
-    printf("\n");
-    std::string output;
-    for (int i = 0; i < max_tgt_len; i++)
-    {
-        const char * tmp = sample(ctx_llama, params, &n_past);
-        if (strcmp(tmp, "</s>") == 0) break;
-
-        output += tmp;
-        printf("%s", tmp);
-        fflush(stdout);
-    }
-    
-    web_response.set_content("{\"error\": false, \"content\": \"" + escape_json(output) + "\"}", "application/json");
-
-    printf("\n");
-
-    {
-        const float t_img_enc_ms = (t_img_enc_end_us - t_img_enc_start_us) / 1000.0;
-        printf("\n%s: image encoded in %8.2f ms by CLIP (%8.2f ms per image patch)\n", __func__, t_img_enc_ms, t_img_enc_ms / n_img_pos);
-    }
-
-    llama_print_timings(ctx_llama);
-
-    free(image_embd);
-}
+    web_server_options web;
+    std::string trace_file;
+    std::string slow_log_file;
+    double slow_threshold_ms = 1000;
+    std::string capture_dir;        // if not empty, sampled /llava requests are captured here
+    double capture_rate = 1.0;      // fraction of requests to capture
+    double embd_cache_mb = 0;
+    double max_inflight_mb = 0;
+    std::vector<std::tuple<std::string, std::string, std::string>> extra_models;   // (name, model, mmproj)
+    std::vector<std::string> preload_models;
+    double model_budget_mb = 0;
+    std::string snapshot_dir;
+    double drain_timeout_s = 30;
+    int n_threads_clip = -1;
+    int n_threads_decode = -1;
+    int n_threads_preprocess = 1;
+    bool n_threads_given = false;           // -t or --threads-decode
+    bool n_threads_batch_given = false;     // -tb
+    bool n_batch_given = false;             // -b
+    bool autotune = false;
+    std::string tune_profile = "llava-server.tune";
+    std::vector<int> stage_cpus[size_t(pipeline_stage::num_stages)];
+    bool numa_replicas = false;
+    std::vector<numa_node> numa_nodes;      // nodes to place replicas on, if numa_replicas
+    huge_page_mode huge_pages = huge_page_mode::off;
+    bool huge_page_weights = false;
+    std::string mmproj_quant;
+    std::string mmproj_cache_dir = "mmproj-cache";
+    bool warmup = false;
+    bool mock_backend = false;
+    mock_backend_options mock;
+};
 
 static void show_additional_info(int /*argc*/, char **argv)
 {
@@ -162,12 +104,59 @@ static void show_additional_info(int /*argc*/, char **argv)
     printf("  --host HOST           host to serve on (default: localhost)\n");
     printf("  --port PORT           port to serve on (default: 8080)\n");
     printf("  --log-http            enable http logging\n");
+    printf("  --trace-file FNAME    write Chrome trace events (chrome://tracing, Perfetto) to FNAME\n");
+    printf("  --slow-log FNAME      append the full timeline of slow requests to FNAME (JSON lines)\n");
+    printf("  --slow-threshold MS   latency above which a request is logged as slow (default: 1000)\n");
+    printf("  --embd-cache-mb N     cache image embeddings of repeated images in up to N MiB (default: 0, off)\n");
+    printf("  --max-inflight-mb N   reject requests once payloads in flight exceed N MiB (default: 0, unlimited)\n");
+    printf("  --capture-dir DIR     capture sampled /llava requests to DIR as a llava-bench corpus\n");
+    printf("  --capture-rate F      fraction of requests to capture (default: 1.0)\n");
+    printf("  --threads-http N      number of HTTP threads (default: available CPUs - 1, at least 8)\n");
+    printf("  --probe-port PORT     also serve /health, /ready, and /load on PORT, with threads of their own so\n");
+    printf("                        that they respond even when every HTTP thread is busy with /llava requests\n");
+    printf("  --threads-preprocess N\n");
+    printf("                        number of requests decoding and preprocessing images at once, overlapped\n");
+    printf("                        with inference (default: 1, 0 for no limit)\n");
+    printf("  --threads-clip N      number of threads for CLIP encoding (default: same as -t)\n");
+    printf("  --threads-decode N    number of threads for LLM generation (same as -t; --threads-batch sets the\n");
+    printf("                        number for prompt prefill)\n");
+    printf("  --cpus-http LIST      pin a stage to a set of CPUs, e.g. 0-3,8 (--cpus-http, --cpus-preprocess,\n");
+    printf("                        --cpus-clip, --cpus-llm)\n");
+    printf("  --autotune            measure the best thread counts and batch size for this host and model, and\n");
+    printf("                        save them to the tuning profile, before starting\n");
+    printf("  --tune-profile FNAME  tuning profile, applied at startup if it has settings for this host and model\n");
+    printf("                        (default: llava-server.tune)\n");
+    printf("  --numa-replicas       load one replica of each model per NUMA node, with node-local memory and\n");
+    printf("                        threads, and send each request to the least loaded replica\n");
+    printf("  --huge-pages MODE     back the KV cache, compute buffers, and image embeddings with huge pages: off,\n");
+    printf("                        thp (transparent), or explicit (reserved 2 MiB pages, falling back to thp)\n");
+    printf("                        (default: off)\n");
+    printf("  --huge-pages-weights  also back the model weights with huge pages, which loads them into memory\n");
+    printf("                        rather than mapping the model file (implies --no-mmap)\n");
+    printf("  --mmproj-quant TYPE   quantize the mmproj to TYPE (q8_0, q5_0, q5_1, q4_0, or q4_1) when loading it,\n");
+    printf("                        reusing a previously quantized copy of the same file if there is one\n");
+    printf("  --mmproj-cache DIR    directory for quantized mmproj files (default: mmproj-cache)\n");
+    printf("  --add-model N,M,P     register model name N with model file M and mmproj file P, selected by the\n");
+    printf("                        \"model\" field of a request (-m and --mmproj are registered as \"default\")\n");
+    printf("  --preload NAME        load a registered model at startup rather than on first use\n");
+    printf("  --model-budget-mb N   evict least recently used models to keep resident models within N MiB\n");
+    printf("                        (default: 0, keep all)\n");
+    printf("  --snapshot-dir DIR    on shutdown (SIGTERM or SIGINT), save cached prompt KV and image embeddings of\n");
+    printf("                        resident models to DIR, and restore them when models are loaded\n");
+    printf("  --drain-timeout S     on shutdown, cut short requests still running after S seconds (default: 30)\n");
+    printf("  --reuse-port          listen with SO_REUSEPORT so that a new server can start on the same port\n");
+    printf("                        before this one is shut down\n");
+    printf("  --admin-token TOKEN   enable /admin endpoints for requests with \"Authorization: Bearer TOKEN\"\n");
+    printf("  --warmup              run a synthetic request through the pipeline before reporting ready\n");
+    printf("  --mock-backend        serve with a mock backend that needs no models (for load testing)\n");
+    printf("  --mock-config SPEC    mock backend latencies in ms and other settings, e.g.\n");
+    printf("                        decode=5,preprocess=10,encode=300,prefill=400,token=30,tokens=64,jitter=0.1\n");
     printf("\n");
     printf("\n example usage: %s -m <llava-v1.5-7b/ggml-model-q5_k.gguf> --mmproj <llava-v1.5-7b/mmproj-model-f16.gguf> [--temp 0.1]\n", argv[0]);
     printf("  note: a lower temperature value like 0.1 is recommended for better quality.\n");
 }
 
-static bool parse_command_line(int argc, char **argv, gpt_params &params, std::string &hostname, int &port, bool &enable_http_logging)
+static bool parse_command_line(int argc, char **argv, gpt_params &params, server_options &options)
 {
     // Convert to vector
     std::vector<char *> args;
@@ -179,7 +168,17 @@ static bool parse_command_line(int argc, char **argv, gpt_params &params, std::s
     // First, handle our custom arguments and then remove them
     for (auto it = args.begin()++; it != args.end(); )
     {
-        if (!strcmp(*it, "--host") || !strcmp(*it, "--port"))
+        if (!strcmp(*it, "--host") || !strcmp(*it, "--port") || !strcmp(*it, "--trace-file") ||
+            !strcmp(*it, "--slow-log") || !strcmp(*it, "--slow-threshold") ||
+            !strcmp(*it, "--embd-cache-mb") || !strcmp(*it, "--max-inflight-mb") || !strcmp(*it, "--admin-token") ||
+            !strcmp(*it, "--add-model") || !strcmp(*it, "--preload") ||
+            !strcmp(*it, "--model-budget-mb") || !strcmp(*it, "--snapshot-dir") || !strcmp(*it, "--drain-timeout") ||
+            !strcmp(*it, "--threads-http") || !strcmp(*it, "--threads-preprocess") || !strcmp(*it, "--threads-clip") ||
+            !strcmp(*it, "--threads-decode") || !strcmp(*it, "--cpus-http") || !strcmp(*it, "--cpus-preprocess") ||
+            !strcmp(*it, "--cpus-clip") || !strcmp(*it, "--cpus-llm") || !strcmp(*it, "--tune-profile") ||
+            !strcmp(*it, "--huge-pages") || !strcmp(*it, "--mmproj-quant") || !strcmp(*it, "--mmproj-cache") ||
+            !strcmp(*it, "--capture-dir") || !strcmp(*it, "--capture-rate") || !strcmp(*it, "--mock-config") ||
+            !strcmp(*it, "--probe-port"))
         {
             char *arg = *it;
             it = args.erase(it);    // remove this element, point to next one
@@ -192,22 +191,185 @@ static bool parse_command_line(int argc, char **argv, gpt_params &params, std::s
             {
                 if (!strcmp(arg, "--host"))
                 {
-                    hostname = *it;
+                    options.web.host = *it;
+                }
+                else if (!strcmp(arg, "--port"))
+                {
+                    options.web.port = std::stoi(*it);
+                }
+                else if (!strcmp(arg, "--trace-file"))
+                {
+                    options.trace_file = *it;
+                }
+                else if (!strcmp(arg, "--slow-log"))
+                {
+                    options.slow_log_file = *it;
+                }
+                else if (!strcmp(arg, "--slow-threshold"))
+                {
+                    options.slow_threshold_ms = std::stod(*it);
+                }
+                else if (!strcmp(arg, "--embd-cache-mb"))
+                {
+                    options.embd_cache_mb = std::stod(*it);
+                }
+                else if (!strcmp(arg, "--max-inflight-mb"))
+                {
+                    options.max_inflight_mb = std::stod(*it);
+                }
+                else if (!strcmp(arg, "--add-model"))
+                {
+                    std::string spec = *it;
+                    size_t comma1 = spec.find(',');
+                    size_t comma2 = comma1 == std::string::npos ? std::string::npos : spec.find(',', comma1 + 1);
+                    if (comma2 == std::string::npos)
+                    {
+                        fprintf(stderr, "error: --add-model requires NAME,MODEL,MMPROJ\n");
+                        return false;
+                    }
+                    options.extra_models.emplace_back(spec.substr(0, comma1), spec.substr(comma1 + 1, comma2 - comma1 - 1), spec.substr(comma2 + 1));
+                }
+                else if (!strcmp(arg, "--preload"))
+                {
+                    options.preload_models.emplace_back(*it);
+                }
+                else if (!strcmp(arg, "--model-budget-mb"))
+                {
+                    options.model_budget_mb = std::stod(*it);
+                }
+                else if (!strcmp(arg, "--snapshot-dir"))
+                {
+                    options.snapshot_dir = *it;
+                }
+                else if (!strcmp(arg, "--threads-http"))
+                {
+                    options.web.n_threads = std::stoi(*it);
+                }
+                else if (!strcmp(arg, "--probe-port"))
+                {
+                    options.web.probe_port = std::stoi(*it);
+                }
+                else if (!strcmp(arg, "--threads-preprocess"))
+                {
+                    options.n_threads_preprocess = std::stoi(*it);
+                }
+                else if (!strcmp(arg, "--threads-clip"))
+                {
+                    options.n_threads_clip = std::stoi(*it);
                 }
-                else
+                else if (!strcmp(arg, "--threads-decode"))
                 {
-                    port = std::stoi(*it);
-                }                
+                    options.n_threads_decode = std::stoi(*it);
+                }
+                else if (!strncmp(arg, "--cpus-", 7))
+                {
+                    const pipeline_stage stage =
+                        !strcmp(arg, "--cpus-http") ? pipeline_stage::http :
+                        !strcmp(arg, "--cpus-preprocess") ? pipeline_stage::preprocess :
+                        !strcmp(arg, "--cpus-clip") ? pipeline_stage::clip : pipeline_stage::llm;
+                    if (!parse_cpu_list(*it, options.stage_cpus[size_t(stage)]))
+                    {
+                        return false;
+                    }
+                }
+                else if (!strcmp(arg, "--tune-profile"))
+                {
+                    options.tune_profile = *it;
+                }
+                else if (!strcmp(arg, "--huge-pages"))
+                {
+                    if (!parse_huge_page_mode(*it, options.huge_pages))
+                    {
+                        fprintf(stderr, "error: --huge-pages must be off, thp, or explicit\n");
+                        return false;
+                    }
+                }
+                else if (!strcmp(arg, "--mmproj-quant"))
+                {
+                    int itype;
+                    if (!parse_mmproj_quant_type(*it, itype))
+                    {
+                        fprintf(stderr, "error: --mmproj-quant must be q8_0, q5_0, q5_1, q4_0, or q4_1\n");
+                        return false;
+                    }
+                    options.mmproj_quant = *it;
+                }
+                else if (!strcmp(arg, "--mmproj-cache"))
+                {
+                    options.mmproj_cache_dir = *it;
+                }
+                else if (!strcmp(arg, "--drain-timeout"))
+                {
+                    options.drain_timeout_s = std::stod(*it);
+                }
+                else if (!strcmp(arg, "--admin-token"))
+                {
+                    options.web.admin_token = *it;
+                }
+                else if (!strcmp(arg, "--capture-dir"))
+                {
+                    options.capture_dir = *it;
+                }
+                else if (!strcmp(arg, "--capture-rate"))
+                {
+                    options.capture_rate = std::stod(*it);
+                }
+                else if (!parse_mock_backend_options(*it, options.mock))
+                {
+                    return false;
+                }
                 it = args.erase(it);
             }
         }
         else if (!strcmp(*it, "--log-http"))
         {
-            enable_http_logging = true;
+            options.web.enable_logging = true;
+            it = args.erase(it);
+        }
+        else if (!strcmp(*it, "--autotune"))
+        {
+            options.autotune = true;
+            it = args.erase(it);
+        }
+        else if (!strcmp(*it, "--numa-replicas"))
+        {
+            options.numa_replicas = true;
+            it = args.erase(it);
+        }
+        else if (!strcmp(*it, "--huge-pages-weights"))
+        {
+            options.huge_page_weights = true;
+            it = args.erase(it);
+        }
+        else if (!strcmp(*it, "--reuse-port"))
+        {
+            options.web.reuse_port = true;
+            it = args.erase(it);
+        }
+        else if (!strcmp(*it, "--warmup"))
+        {
+            options.warmup = true;
+            it = args.erase(it);
+        }
+        else if (!strcmp(*it, "--mock-backend"))
+        {
+            options.mock_backend = true;
             it = args.erase(it);
         }
         else
         {
+            if (!strcmp(*it, "-t") || !strcmp(*it, "--threads"))
+            {
+                options.n_threads_given = true;
+            }
+            else if (!strcmp(*it, "-tb") || !strcmp(*it, "--threads-batch"))
+            {
+                options.n_threads_batch_given = true;
+            }
+            else if (!strcmp(*it, "-b") || !strcmp(*it, "--batch-size"))
+            {
+                options.n_batch_given = true;
+            }
             ++it;
         }
     }
@@ -222,6 +384,11 @@ static bool parse_command_line(int argc, char **argv, gpt_params &params, std::s
     
     // Parse using llama.cpp parser
     bool success = gpt_params_parse(new_argc, new_argv, params);
+    if (options.n_threads_decode > 0)
+    {
+        params.n_threads = options.n_threads_decode;
+        options.n_threads_given = true;
+    }
 
     // Clean up
     delete [] new_argv;
@@ -229,65 +396,600 @@ static bool parse_command_line(int argc, char **argv, gpt_params &params, std::s
     return success;
 }
 
+// Runs autotuning, or looks up previously tuned settings for this host and model, and applies
+// them to the settings that were not given explicitly. Returns false if tuning failed.
+static bool apply_tuned_settings(gpt_params &params, server_options &options, int available_cpus)
+{
+    const std::string key = autotune_key(params, options.mmproj_quant, available_cpus);
+    tuned_settings settings;
+    if (options.autotune)
+    {
+        // CLIP is tuned on the mmproj that backends will load, which falls back to the original
+        // file if it cannot be quantized
+        gpt_params tune_params = params;
+        if (!options.mmproj_quant.empty())
+        {
+            const std::string quantized = mmproj_quantized_path(params.mmproj, options.mmproj_quant, options.mmproj_cache_dir);
+            if (!quantized.empty())
+            {
+                tune_params.mmproj = quantized;
+            }
+        }
+        if (!autotune(tune_params, available_cpus, settings))
+        {
+            return false;
+        }
+        if (autotune_save_profile(options.tune_profile, key, settings))
+        {
+            printf("%s: tuned settings saved to %s\n", __func__, options.tune_profile.c_str());
+        }
+    }
+    else if (autotune_load_profile(options.tune_profile, key, settings))
+    {
+        printf("%s: using tuned settings from %s\n", __func__, options.tune_profile.c_str());
+    }
+    else
+    {
+        return true;
+    }
+
+    if (!options.n_threads_given)
+    {
+        params.n_threads = settings.n_threads;
+    }
+    if (!options.n_threads_batch_given)
+    {
+        params.n_threads_batch = settings.n_threads_batch;
+    }
+    if (!options.n_batch_given)
+    {
+        params.n_batch = settings.n_batch;
+    }
+    if (options.n_threads_clip <= 0)
+    {
+        options.n_threads_clip = settings.n_threads_clip;
+    }
+    return true;
+}
+
+// Thread counts that were not given explicitly are limited to the CPUs the process can actually
+// use. llama.cpp's defaults are based on the host's cores, which in a container with a CPU quota
+// leads to oversubscription and throttling.
+static void apply_cpu_limits(gpt_params &params, server_options &options, const cpu_limits &limits)
+{
+    const int available = limits.available();
+    if (!options.n_threads_given)
+    {
+        params.n_threads = std::min(params.n_threads, available);
+    }
+    if (!options.n_threads_batch_given && params.n_threads_batch > available)
+    {
+        params.n_threads_batch = available;
+    }
+    if (options.n_threads_clip <= 0)
+    {
+        options.n_threads_clip = std::min(params.n_threads, available);
+    }
+    if (options.web.n_threads <= 0)
+    {
+        // HTTP threads mostly wait on sockets, so keep cpp-httplib's floor of 8
+        options.web.n_threads = std::max(8, available - 1);
+    }
+
+    printf("%s: CPUs: %s\n", __func__, limits.description().c_str());
+    printf("%s: threads: decode %d, batch %d, CLIP %d, HTTP %d, preprocess %d\n", __func__,
+        params.n_threads, params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads,
+        options.n_threads_clip, options.web.n_threads, options.n_threads_preprocess);
+}
+
+// Restores a new backend's snapshot, if there is one, and optionally warms it up
+static bool finish_loading(inference_backend &backend, const server_options &options, const std::string &name, bool warmup)
+{
+    if (!options.snapshot_dir.empty())
+    {
+        backend.load_snapshot(options.snapshot_dir + "/" + name);
+    }
+    return !warmup || warmup_backend(backend);
+}
+
+// Loads one replica per NUMA node, in parallel. Each is loaded by a thread pinned to its node, so
+// that its weights, KV cache, and compute buffers are allocated in the node's memory, and it
+// processes requests on the node's CPUs.
+static std::unique_ptr<inference_backend> create_numa_replicas(const std::vector<numa_node> &nodes, const gpt_params &params, const server_options &options, const std::string &name, bool warmup)
+{
+    std::vector<std::unique_ptr<inference_backend>> backends(nodes.size());
+    std::vector<std::vector<int>> cpus;
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        cpus.emplace_back(nodes[i].cpus);
+        threads.emplace_back([&, i]()
+        {
+            const numa_node &node = nodes[i];
+            const int n_cpus = node.n_threads;
+            stage_affinity affinity(node.cpus);
+            numa_memory_scope memory(node.id);
+
+            // Mapped weights would be shared page cache on whichever node first read them
+            gpt_params node_params = params;
+            node_params.use_mmap = false;
+            node_params.numa = false;
+            node_params.n_threads = std::min(params.n_threads, n_cpus);
+            node_params.n_threads_batch = params.n_threads_batch > 0 ? std::min(params.n_threads_batch, n_cpus) : -1;
+
+            llava_backend_options llava_options;
+            llava_options.n_threads_clip = options.n_threads_clip > 0 ? std::min(options.n_threads_clip, n_cpus) : -1;
+            llava_options.numa_node = node.id;
+            llava_options.huge_page_weights = options.huge_page_weights;
+            llava_options.mmproj_quant = options.mmproj_quant;
+            llava_options.mmproj_cache_dir = options.mmproj_cache_dir;
+            auto llava = std::make_unique<llava_backend>(node_params, llava_options);
+            if (llava->load() && finish_loading(*llava, options, name, warmup))
+            {
+                backends[i] = std::move(llava);
+            }
+        });
+    }
+    for (std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (!backends[i])
+        {
+            fprintf(stderr, "%s: error: unable to load replica on NUMA node %d\n", __func__, nodes[i].id);
+            return nullptr;
+        }
+    }
+
+    printf("%s: loaded %zu replicas of %s, one per NUMA node\n", __func__, nodes.size(), params.model.c_str());
+    return std::make_unique<replica_backend>(std::move(backends), cpus);
+}
+
+static std::unique_ptr<inference_backend> create_backend(const gpt_params &params, const server_options &options, const std::string &name, bool warmup)
+{
+    std::unique_ptr<inference_backend> backend;
+    if (options.mock_backend)
+    {
+        backend = std::make_unique<mock_backend>(options.mock);
+    }
+    else if (options.numa_nodes.size() > 1)
+    {
+        return create_numa_replicas(options.numa_nodes, params, options, name, warmup);
+    }
+    else
+    {
+        llava_backend_options llava_options;
+        llava_options.n_threads_clip = options.n_threads_clip;
+        llava_options.huge_page_weights = options.huge_page_weights;
+        llava_options.mmproj_quant = options.mmproj_quant;
+        llava_options.mmproj_cache_dir = options.mmproj_cache_dir;
+        auto llava = std::make_unique<llava_backend>(params, llava_options);
+        if (!llava->load())
+        {
+            return nullptr;
+        }
+        backend = std::move(llava);
+    }
+    return finish_loading(*backend, options, name, warmup) ? std::move(backend) : nullptr;
+}
+
+// Loads a backend for the given files, restores its snapshot if there is one, and optionally
+// warms it up
+static std::shared_ptr<active_backend> load_backend(gpt_params params, const server_options &options, const std::string &name, const model_files &files, bool warmup)
+{
+    params.model = files.model_path;
+    params.mmproj = files.mmproj_path;
+
+    auto active = std::make_shared<active_backend>();
+    active->backend = create_backend(params, options, name, warmup);
+    if (!active->backend)
+    {
+        return nullptr;
+    }
+    return active;
+}
+
+// Saves the caches of each resident model for the next instance to restore. With skip_busy,
+// models that are still processing a request are skipped rather than waited for.
+static void save_snapshots(const model_registry &registry, const std::string &dir, bool skip_busy = false)
+{
+    mkdir(dir.c_str(), 0755);
+    for (auto &[name, active] : registry.resident())
+    {
+        std::unique_lock lock(active->mtx, std::defer_lock);
+        if (!skip_busy)
+        {
+            lock.lock();
+        }
+        else if (!lock.try_lock())
+        {
+            fprintf(stderr, "%s: model %s is busy, not saving its snapshot\n", __func__, name.c_str());
+            continue;
+        }
+        if (active->backend->save_snapshot(dir + "/" + name))
+        {
+            printf("%s: saved snapshot of model %s to %s\n", __func__, name.c_str(), dir.c_str());
+        }
+    }
+}
+
+// Loads and warms up replacement files for a model (empty paths keep the current files),
+// switches new requests over to them, and frees the old backend once requests still using it
+// have drained.
+static void reload_backend(model_registry &registry, const gpt_params &params, const server_options &options, const std::string &name, const std::string &model_path, const std::string &mmproj_path)
+{
+    trace_set_thread_name("reload");
+
+    model_files files;
+    registry.files(name, files);
+    if (!model_path.empty())
+    {
+        files.model_path = model_path;
+    }
+    if (!mmproj_path.empty())
+    {
+        files.mmproj_path = mmproj_path;
+    }
+
+    printf("%s: loading %s with %s for model %s\n", __func__, files.model_path.c_str(), files.mmproj_path.c_str(), name.c_str());
+    std::shared_ptr<active_backend> replacement = load_backend(params, options, name, files, /*warmup=*/ true);
+    if (!replacement)
+    {
+        fprintf(stderr, "%s: error: reload failed, continuing to serve the current files\n", __func__);
+        return;
+    }
+
+    std::shared_ptr<active_backend> old = registry.replace(name, files, std::move(replacement));
+    printf("%s: new requests for model %s are now served by %s\n", __func__, name.c_str(), files.model_path.c_str());
+
+    // Free the old backend here rather than on whichever request thread happens to drop the last
+    // reference to it
+    backend_slot::free_when_released(std::move(old));
+    printf("%s: previous backend drained and freed\n", __func__);
+}
+
 int main(int argc, char ** argv)
 {
     ggml_time_init();
 
+    // Signals are handled synchronously by a dedicated thread, so block them before any other
+    // threads are created (they inherit the mask)
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGHUP);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+
     gpt_params params;
 
-    std::string hostname = "localhost";
-    int port = 8080;
-    bool enable_http_logging = false;
-    if (!parse_command_line(argc, argv, params, hostname, port, enable_http_logging))
+    server_options options;
+    if (!parse_command_line(argc, argv, params, options))
     {
         show_additional_info(argc, argv);
         return 1;
     }
 
-    if (params.mmproj.empty())
+    if (params.mmproj.empty() && !options.mock_backend)
     {
         gpt_print_usage(argc, argv, params);
         show_additional_info(argc, argv);
         return 1;
     }
 
-    const char * clip_path = params.mmproj.c_str();
-
-    auto ctx_clip = clip_model_load(clip_path, /*verbosity=*/ 1);
-
-    llama_backend_init(params.numa);
+    // The llama.cpp revision this server is built against can only merge an adapter into a private
+    // copy of the weights, which defeats the point of serving adapters over one shared base model
+    if (!params.lora_adapter.empty())
+    {
+        fprintf(stderr, "error: LoRA adapters are not supported; serve a merged model instead\n");
+        return 1;
+    }
 
-    llama_model_params model_params = llama_model_default_params();
-    llama_model * model = llama_load_model_from_file(params.model.c_str(), model_params);
-    if (model == NULL)
+    if (!options.trace_file.empty() && !trace_open(options.trace_file))
     {
-        fprintf(stderr , "%s: error: unable to load model\n" , __func__);
         return 1;
     }
+    trace_set_thread_name("main");
 
-    llama_context_params ctx_params = llama_context_default_params();
+    if (!options.slow_log_file.empty() && !slow_log_open(options.slow_log_file, int64_t(options.slow_threshold_ms * 1000)))
+    {
+        return 1;
+    }
 
-    ctx_params.n_ctx           = params.n_ctx < 2048 ? 2048 : params.n_ctx; // we need a longer context size to process image embeddings
-    ctx_params.n_threads       = params.n_threads;
-    ctx_params.n_threads_batch = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+    if (!options.capture_dir.empty() && !capture_open(options.capture_dir, options.capture_rate))
+    {
+        return 1;
+    }
 
-    // create a llama context once that we'll reuse for each request
-    llama_context * ctx_llama = llama_new_context_with_model(model, ctx_params);
-    if (ctx_llama == NULL)
+    const cpu_limits limits = read_cpu_limits();
+    if (!options.mock_backend && !apply_tuned_settings(params, options, limits.available()))
     {
-        fprintf(stderr , "%s: error: failed to create the llama_context\n" , __func__);
         return 1;
     }
+    apply_cpu_limits(params, options, limits);
+    for (size_t i = 0; i < size_t(pipeline_stage::num_stages); i++)
+    {
+        set_stage_cpus(pipeline_stage(i), options.stage_cpus[i]);
+    }
 
-    // Serve forever
-    std::mutex mtx;
-    run_web_server(hostname, port, enable_http_logging,
-        [&mtx, &params, ctx_clip, ctx_llama](const llava_request &request, httplib::Response &response)
+    if (options.numa_replicas && !options.mock_backend)
+    {
+        options.numa_nodes = numa_nodes();
+        if (options.numa_nodes.size() > 1)
+        {
+            // Replicas run concurrently, so each gets its node's share of the CPU quota
+            for (numa_node &node : options.numa_nodes)
+            {
+                node.n_threads = limits.available_on(int(node.cpus.size()));
+                printf("NUMA node %d: %zu CPUs available, up to %d threads\n", node.id, node.cpus.size(), node.n_threads);
+            }
+            server_status_set_slots(int(options.numa_nodes.size()));
+        }
+        else
         {
-            std::unique_lock lock(mtx);
-            perform_inference(request, response, params, ctx_clip, ctx_llama);
+            fprintf(stderr, "warning: --numa-replicas: fewer than two NUMA nodes found, loading a single replica\n");
+            options.numa_nodes.clear();
         }
+    }
+
+    huge_pages_init(options.huge_pages);
+
+    // Weights mapped from the model file are in the page cache, where huge pages cannot be advised
+    if (options.huge_page_weights)
+    {
+        params.use_mmap = false;
+    }
+
+    memory_set_budget(memory_component::embd_cache, int64_t(options.embd_cache_mb * 1024 * 1024));
+    memory_set_budget(memory_component::inflight_payloads, int64_t(options.max_inflight_mb * 1024 * 1024));
+
+    // Models other than the default one are loaded on first use
+    model_registry registry(
+        [&params, &options](const std::string &name, const model_files &files)
+        {
+            return load_backend(params, options, name, files, /*warmup=*/ false);
+        },
+        int64_t(options.model_budget_mb * 1024 * 1024),
+        std::max(1, int(options.numa_nodes.size()))
     );
+    const model_files default_files = { params.model, params.mmproj };
+    registry.add("default", default_files);
+    for (auto &[name, model_path, mmproj_path] : options.extra_models)
+    {
+        model_files files;
+        files.model_path = model_path;
+        files.mmproj_path = mmproj_path;
+        registry.add(name, files);
+    }
+
+    for (const std::string &name : options.preload_models)
+    {
+        if (!registry.contains(name))
+        {
+            fprintf(stderr, "error: --preload %s: model is not registered\n", name.c_str());
+            return 1;
+        }
+    }
+
+    // Load (and optionally warm up) the default model, plus any models to preload, in the
+    // background so that /health and /ready are served while starting up. If loading fails, the
+    // web server is stopped and main() exits with an error.
+    std::atomic<bool> startup_failed(false);
+    std::thread startup_thread([&registry, &params, &options, &default_files, &startup_failed]()
+    {
+        trace_set_thread_name("startup");
+        std::shared_ptr<active_backend> active = load_backend(params, options, "default", default_files, options.warmup);
+        bool ok = active != nullptr;
+        if (ok)
+        {
+            registry.replace("default", default_files, std::move(active));
+        }
+        for (size_t i = 0; ok && i < options.preload_models.size(); i++)
+        {
+            ok = registry.acquire(options.preload_models[i]) != nullptr;
+        }
+        if (!ok)
+        {
+            startup_failed = true;
+            stop_web_server();
+            return;
+        }
+        server_status_set_ready(true);
+    });
+
+    // Hot reload, requested through /admin/reload or SIGHUP (which reloads the default model's
+    // current files)
+    std::mutex reload_mtx;
+    std::thread reload_thread;
+    std::atomic<bool> reloading(false);
+    auto request_reload = [&](const std::string &name, const std::string &model_path, const std::string &mmproj_path) -> bool
+    {
+        std::lock_guard<std::mutex> lock(reload_mtx);
+        if (reloading || !server_status_is_ready() || !registry.contains(name))
+        {
+            return false;
+        }
+        if (reload_thread.joinable())
+        {
+            reload_thread.join();   // previous reload, already finished
+        }
+        reloading = true;
+        reload_thread = std::thread([&, name, model_path, mmproj_path]()
+        {
+            reload_backend(registry, params, options, name, model_path, mmproj_path);
+            reloading = false;
+        });
+        return true;
+    };
+
+    // SIGTERM and SIGINT shut down gracefully: stop reporting ready, close the listening socket,
+    // and let requests in progress finish within the drain timeout. A second signal exits
+    // immediately. If requests have not wound down shortly after the timeout, the server saves the
+    // snapshots of idle models, closes its logs, and exits.
+    std::thread signal_thread([&signals, &request_reload, &options, &registry]()
+    {
+        int sig;
+        bool stopping = false;
+        while (sigwait(&signals, &sig) == 0)
+        {
+            if (sig == SIGHUP)
+            {
+                if (!request_reload("default", "", ""))
+                {
+                    fprintf(stderr, "SIGHUP: unable to reload now (starting up or already reloading)\n");
+                }
+            }
+            else if (stopping)
+            {
+                _exit(1);
+            }
+            else
+            {
+                printf("%s: shutting down, draining requests for up to %.1f s\n", strsignal(sig), options.drain_timeout_s);
+                stopping = true;
+                const int64_t drain_timeout_us = int64_t(options.drain_timeout_s * 1e6);
+                server_status_begin_drain(drain_timeout_us);
+                stop_web_server();
+                std::thread([drain_timeout_us, &options, &registry]()
+                {
+                    std::this_thread::sleep_for(std::chrono::microseconds(drain_timeout_us) + k_drain_grace);
+                    if (!s_drained)
+                    {
+                        fprintf(stderr, "error: requests did not finish draining, exiting\n");
+
+                        // Save what can be saved without waiting on the stuck requests, giving up
+                        // after another grace period (a replica may still hold its lock)
+                        if (!options.snapshot_dir.empty())
+                        {
+                            std::packaged_task<void()> save([&options, &registry]() { save_snapshots(registry, options.snapshot_dir, /*skip_busy=*/ true); });
+                            std::future<void> saved = save.get_future();
+                            std::thread(std::move(save)).detach();
+                            saved.wait_for(k_drain_grace);
+                        }
+                        capture_close();
+                        slow_log_close();
+                        trace_close();
+                        _exit(1);
+                    }
+                }).detach();
+            }
+        }
+    });
+    signal_thread.detach();
+
+    // Serve until shut down
+    web_server_handlers handlers;
+    handlers.request_reload = request_reload;
+    handlers.list_models = [&registry]() { return registry.status_json(); };
+    stage_limiter preprocess_limiter(options.n_threads_preprocess);
+    handlers.hand_off_request = [&registry, &preprocess_limiter](const llava_request &request, httplib::Response &response)
+    {
+        const int64_t t_hand_off_us = ggml_time_us();
+        metrics_increment(metric_counter::requests);
+        if (!server_status_is_ready())
+        {
+            response.status = 503;
+            set_error_response(response, server_status_is_draining() ? "server is shutting down" : "server is not ready");
+            return;
+        }
+        if (!registry.contains(request.model))
+        {
+            response.status = 404;
+            set_error_response(response, "unknown model: " + request.model);
+            return;
+        }
 
+        // Waiting for a model to be loaded on demand counts as queue wait
+        metrics_gauge_add(metric_gauge::queue_depth, 1);
+        slow_log_begin(t_hand_off_us);
+        std::shared_ptr<active_backend> active = registry.acquire(request.model);
+        if (!active)
+        {
+            metrics_gauge_add(metric_gauge::queue_depth, -1);
+            response.status = 503;
+            set_error_response(response, "unable to load model: " + request.model);
+            const int64_t total_us = record_stage(metric_stage::total, "request", t_hand_off_us, ggml_time_us());
+            slow_log_end(request, inference_timings(), total_us, true);
+            return;
+        }
+
+        // Image decoding and preprocessing happen before waiting for the backend, overlapping
+        // with the request it is processing. Requests still queued when the drain deadline
+        // passes are not started.
+        inference_timings timings;
+        preprocess_limiter.acquire();
+        const int64_t t_prepare_start_us = ggml_time_us();
+        std::unique_ptr<prepared_input> input;
+        if (!drain_deadline_passed(response))
+        {
+            input = active->backend->prepare(request, response, timings);
+        }
+        preprocess_limiter.release();
+        const int64_t t_prepare_end_us = ggml_time_us();
+        if (!input)
+        {
+            metrics_gauge_add(metric_gauge::queue_depth, -1);
+            const int64_t total_us = record_stage(metric_stage::total, "request", t_hand_off_us, t_prepare_end_us);
+            slow_log_end(request, timings, total_us, true);
+            return;
+        }
+
+        // Backends that are not concurrent process one request at a time
+        std::unique_lock lock(active->mtx, std::defer_lock);
+        if (!active->backend->concurrent())
+        {
+            lock.lock();
+        }
+        metrics_gauge_add(metric_gauge::queue_depth, -1);
+        if (drain_deadline_passed(response))
+        {
+            const int64_t total_us = record_stage(metric_stage::total, "request", t_hand_off_us, ggml_time_us());
+            slow_log_end(request, timings, total_us, true);
+            return;
+        }
+        metrics_gauge_add(metric_gauge::active_slots, 1);
+
+        // Queue wait covers waiting to prepare (including on-demand model loads) and waiting for
+        // the backend
+        timings.queue_wait_us = (t_prepare_start_us - t_hand_off_us) +
+            record_stage(metric_stage::queue_wait, "queue_wait", t_prepare_end_us, ggml_time_us());
+
+        const int64_t t_start_us = ggml_time_us();
+        active->backend->perform_inference(request, *input, response, t_hand_off_us, timings);
+        const int64_t t_end_us = ggml_time_us();
+
+        metrics_gauge_add(metric_gauge::active_slots, -1);
+        server_status_record_service_time(t_end_us - t_start_us);
+        const int64_t total_us = record_stage(metric_stage::total, "request", t_hand_off_us, t_end_us);
+        slow_log_end(request, timings, total_us, is_error_response(response));
+    };
+    const bool served = run_web_server(options.web, handlers);
+    s_drained = true;
+
+    startup_thread.join();
+    if (startup_failed || !served)
+    {
+        fprintf(stderr, "error: %s, exiting\n", served ? "unable to load models" : "unable to serve");
+        capture_close();
+        slow_log_close();
+        trace_close();
+        return 1;
+    }
+    {
+        std::lock_guard<std::mutex> lock(reload_mtx);
+        if (reload_thread.joinable())
+        {
+            reload_thread.join();
+        }
+    }
+    if (!options.snapshot_dir.empty())
+    {
+        save_snapshots(registry, options.snapshot_dir);
+    }
+    capture_close();
+    slow_log_close();
+    trace_close();
     return 0;
 }
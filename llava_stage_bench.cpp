@@ -0,0 +1,657 @@
+/*
+ * llava_stage_bench.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Microbenchmarks for the individual stages of the inference pipeline, run in-process against
+ * real models:
+ *
+ *      - image decode (clip_image_load_from_memory) for each input image
+ *      - CLIP preprocessing (clip_image_preprocess) for each input image
+ *      - CLIP encode (clip_image_encode) across thread counts, for the mmproj as given and for
+ *        quantized copies of it, along with how far their embeddings drift from the original's
+ *      - prompt and image embedding prefill (llava_eval_string, llava_eval_image_embd) across
+ *        batch sizes
+ *      - per-token sampling and evaluation (llava_sample)
+ *
+ * Prefill and sampling are measured for each KV cache type given. The KV cache size of each type
+ * is reported, along with how much its logits and greedy generation drift from those of the first
+ * type, so that memory savings can be weighed against throughput and quality.
+ *
+ * Each measurement is repeated and summarized with robust statistics (median, MAD, percentiles)
+ * after discarding warm-up repetitions. If no images are given, synthetic BMPs of several sizes
+ * are used.
+ *
+ * Sample usage:
+ *
+ *      bin/llava-stage-bench -m ggml-model-q5_k.gguf --mmproj mmproj-model-f16.gguf --images a.jpg,b.png --output stages.json
+ */
+
+#include "llava_eval.hpp"
+#include "llava_image.hpp"
+#include "mmproj_quant.hpp"
+
+#include "llama.cpp/examples/llava/clip.h"
+#include "llama.cpp/common/common.h"
+#include "llama.cpp/llama.h"
+#include "llama.cpp/examples/server/json.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+struct stage_bench_options
+{
+    std::vector<std::string> images;
+    std::vector<int> thread_counts;
+    std::vector<int> batch_sizes = { 32, 64, 128, 256, 512 };
+    int repetitions = 10;
+    int warmup_repetitions = 2;
+    int sample_tokens = 32;
+    int quality_tokens = 64;
+    std::vector<std::string> kv_types;      // "f16" or "f32" (default: per --memory-f32)
+    std::vector<std::string> mmproj_quant_types;
+    std::string mmproj_cache_dir = "mmproj-cache";
+    std::string output_file;
+};
+
+struct bench_input_image
+{
+    std::string name;
+    std::vector<uint8_t> data;
+};
+
+struct robust_stats
+{
+    size_t n = 0;
+    double min = 0;
+    double p10 = 0;
+    double median = 0;
+    double p90 = 0;
+    double max = 0;
+    double mean = 0;
+    double mad = 0;     // median absolute deviation
+};
+
+static double quantile(const std::vector<double> &sorted, double q)
+{
+    // Linear interpolation between closest ranks
+    double pos = q * (sorted.size() - 1);
+    size_t lo = size_t(std::floor(pos));
+    size_t hi = std::min(lo + 1, sorted.size() - 1);
+    return sorted[lo] + (sorted[hi] - sorted[lo]) * (pos - lo);
+}
+
+static robust_stats compute_stats(std::vector<double> samples)
+{
+    robust_stats stats;
+    if (samples.empty())
+    {
+        return stats;
+    }
+
+    std::sort(samples.begin(), samples.end());
+    stats.n = samples.size();
+    stats.min = samples.front();
+    stats.max = samples.back();
+    stats.p10 = quantile(samples, 0.10);
+    stats.median = quantile(samples, 0.50);
+    stats.p90 = quantile(samples, 0.90);
+    for (double sample : samples)
+    {
+        stats.mean += sample;
+    }
+    stats.mean /= samples.size();
+
+    std::vector<double> deviations;
+    for (double sample : samples)
+    {
+        deviations.push_back(std::fabs(sample - stats.median));
+    }
+    std::sort(deviations.begin(), deviations.end());
+    stats.mad = quantile(deviations, 0.50);
+
+    return stats;
+}
+
+static json results = json::array();
+
+static void record(const std::string &stage, const json &config, const std::vector<double> &samples_ms)
+{
+    robust_stats stats = compute_stats(samples_ms);
+    printf("  %-18s %-28s median %10.3f  mad %8.3f  p10 %10.3f  p90 %10.3f  min %10.3f ms (n=%zu)\n",
+        stage.c_str(), config.dump().c_str(), stats.median, stats.mad, stats.p10, stats.p90, stats.min, stats.n);
+    results.push_back(
+    {
+        { "stage", stage },
+        { "config", config },
+        { "unit", "ms" },
+        { "n", stats.n },
+        { "min", stats.min },
+        { "p10", stats.p10 },
+        { "median", stats.median },
+        { "p90", stats.p90 },
+        { "max", stats.max },
+        { "mean", stats.mean },
+        { "mad", stats.mad }
+    });
+}
+
+// Runs fn (warmup + repetitions) times, returning the timings (ms) of the non-warm-up runs.
+// setup, if given, runs untimed before each repetition.
+static std::vector<double> measure(const stage_bench_options &options, const std::function<void()> &fn, const std::function<void()> &setup = nullptr)
+{
+    std::vector<double> samples;
+    for (int i = 0; i < options.warmup_repetitions + options.repetitions; i++)
+    {
+        if (setup)
+        {
+            setup();
+        }
+        const int64_t t_start_us = ggml_time_us();
+        fn();
+        const int64_t t_end_us = ggml_time_us();
+        if (i >= options.warmup_repetitions)
+        {
+            samples.push_back((t_end_us - t_start_us) / 1000.0);
+        }
+    }
+    return samples;
+}
+
+static std::vector<std::string> parse_string_list(const char *s)
+{
+    std::vector<std::string> values;
+    std::string list(s);
+    size_t pos = 0;
+    while (pos <= list.size())
+    {
+        size_t end = list.find(',', pos);
+        if (end == std::string::npos)
+        {
+            end = list.size();
+        }
+        if (end > pos)
+        {
+            values.push_back(list.substr(pos, end - pos));
+        }
+        pos = end + 1;
+    }
+    return values;
+}
+
+static std::vector<int> parse_int_list(const char *s)
+{
+    std::vector<int> values;
+    for (const std::string &value : parse_string_list(s))
+    {
+        values.push_back(std::stoi(value));
+    }
+    return values;
+}
+
+static void show_additional_info(int /*argc*/, char **argv)
+{
+    printf("\n stage benchmark options:\n");
+    printf("  --images A,B,...      images to decode and encode (default: synthetic BMPs of several sizes)\n");
+    printf("  --bench-threads N,... CLIP encode thread counts (default: 1,2,4,... up to -t)\n");
+    printf("  --bench-batch N,...   prefill batch sizes (default: 32,64,128,256,512)\n");
+    printf("  --repetitions N       timed repetitions per measurement (default: 10)\n");
+    printf("  --warmup N            untimed warm-up repetitions per measurement (default: 2)\n");
+    printf("  --sample-tokens N     tokens to sample per repetition (default: 32)\n");
+    printf("  --mmproj-quant T,...  mmproj quantization types to compare with the given mmproj, e.g. q8_0,q4_0\n");
+    printf("  --mmproj-cache DIR    directory for quantized mmproj files (default: mmproj-cache)\n");
+    printf("  --kv-types T,...      KV cache types to compare, f16 and/or f32 (default: f16, or f32 with\n");
+    printf("                        --memory-f32); the first is the reference for quality\n");
+    printf("  --quality-tokens N    greedy tokens generated to compare KV types (default: 64)\n");
+    printf("  --output FNAME        write results as JSON to FNAME\n");
+    printf("\n example usage: %s -m <llava-v1.5-7b/ggml-model-q5_k.gguf> --mmproj <llava-v1.5-7b/mmproj-model-f16.gguf> --output stages.json\n", argv[0]);
+}
+
+static bool parse_command_line(int argc, char **argv, gpt_params &params, stage_bench_options &options)
+{
+    std::vector<char *> args(argv, argv + argc);
+
+    // Handle our custom arguments and then remove them
+    for (auto it = args.begin() + 1; it != args.end(); )
+    {
+        if (!strcmp(*it, "--images") || !strcmp(*it, "--bench-threads") || !strcmp(*it, "--bench-batch") ||
+            !strcmp(*it, "--repetitions") || !strcmp(*it, "--warmup") || !strcmp(*it, "--sample-tokens") ||
+            !strcmp(*it, "--kv-types") || !strcmp(*it, "--mmproj-quant") || !strcmp(*it, "--mmproj-cache") || !strcmp(*it, "--quality-tokens") || !strcmp(*it, "--output"))
+        {
+            char *arg = *it;
+            it = args.erase(it);
+            if (it == args.end())
+            {
+                fprintf(stderr, "error: %s requires one argument.\n", arg);
+                return false;
+            }
+            if (!strcmp(arg, "--images"))
+            {
+                options.images = parse_string_list(*it);
+            }
+            else if (!strcmp(arg, "--bench-threads"))
+            {
+                options.thread_counts = parse_int_list(*it);
+            }
+            else if (!strcmp(arg, "--bench-batch"))
+            {
+                options.batch_sizes = parse_int_list(*it);
+            }
+            else if (!strcmp(arg, "--repetitions"))
+            {
+                options.repetitions = std::max(1, std::stoi(*it));
+            }
+            else if (!strcmp(arg, "--warmup"))
+            {
+                options.warmup_repetitions = std::max(0, std::stoi(*it));
+            }
+            else if (!strcmp(arg, "--sample-tokens"))
+            {
+                options.sample_tokens = std::max(1, std::stoi(*it));
+            }
+            else if (!strcmp(arg, "--kv-types"))
+            {
+                options.kv_types = parse_string_list(*it);
+                for (const std::string &kv_type : options.kv_types)
+                {
+                    if (kv_type != "f16" && kv_type != "f32")
+                    {
+                        fprintf(stderr, "error: unsupported KV cache type: %s\n", kv_type.c_str());
+                        return false;
+                    }
+                }
+            }
+            else if (!strcmp(arg, "--mmproj-quant"))
+            {
+                options.mmproj_quant_types = parse_string_list(*it);
+                for (const std::string &type : options.mmproj_quant_types)
+                {
+                    int itype;
+                    if (!parse_mmproj_quant_type(type, itype))
+                    {
+                        fprintf(stderr, "error: unsupported mmproj quantization type: %s\n", type.c_str());
+                        return false;
+                    }
+                }
+            }
+            else if (!strcmp(arg, "--mmproj-cache"))
+            {
+                options.mmproj_cache_dir = *it;
+            }
+            else if (!strcmp(arg, "--quality-tokens"))
+            {
+                options.quality_tokens = std::max(1, std::stoi(*it));
+            }
+            else
+            {
+                options.output_file = *it;
+            }
+            it = args.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    return gpt_params_parse(int(args.size()), args.data(), params);
+}
+
+static bool load_input_images(const stage_bench_options &options, std::vector<bench_input_image> &images)
+{
+    if (options.images.empty())
+    {
+        for (int size : { 224, 336, 672, 1024, 2048 })
+        {
+            images.push_back({ "synthetic-" + std::to_string(size) + ".bmp", make_synthetic_bmp(size, size) });
+        }
+        return true;
+    }
+
+    for (const std::string &path : options.images)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            fprintf(stderr, "error: unable to read image %s\n", path.c_str());
+            return false;
+        }
+        bench_input_image image;
+        image.name = path;
+        image.data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        images.emplace_back(std::move(image));
+    }
+    return true;
+}
+
+// Differences between embeddings of the same image, overall and per patch (cosine similarity)
+static json embedding_drift(const std::vector<float> &reference, const std::vector<float> &embd, int n_embd)
+{
+    double sum_sq_diff = 0;
+    double sum_sq_ref = 0;
+    double max_abs = 0;
+    double sum_cos = 0;
+    double min_cos = 1;
+    const size_t n_patches = reference.size() / size_t(n_embd);
+    for (size_t p = 0; p < n_patches; p++)
+    {
+        double dot = 0, norm_ref = 0, norm_embd = 0;
+        for (size_t i = p * n_embd; i < (p + 1) * n_embd; i++)
+        {
+            const double diff = double(embd[i]) - reference[i];
+            sum_sq_diff += diff * diff;
+            max_abs = std::max(max_abs, std::fabs(diff));
+            dot += double(embd[i]) * reference[i];
+            norm_ref += double(reference[i]) * reference[i];
+            norm_embd += double(embd[i]) * embd[i];
+        }
+        sum_sq_ref += norm_ref;
+        const double cos = norm_ref > 0 && norm_embd > 0 ? dot / std::sqrt(norm_ref * norm_embd) : 0;
+        sum_cos += cos;
+        min_cos = std::min(min_cos, cos);
+    }
+
+    return
+    {
+        { "rms_diff", std::sqrt(sum_sq_diff / std::max<size_t>(1, reference.size())) },
+        { "relative_rms_diff", sum_sq_ref > 0 ? std::sqrt(sum_sq_diff / sum_sq_ref) : 0 },
+        { "max_abs_diff", max_abs },
+        { "mean_patch_cosine", n_patches > 0 ? sum_cos / n_patches : 0 },
+        { "min_patch_cosine", min_cos }
+    };
+}
+
+static const std::string k_system_prompt = "A chat between a curious human and an artificial intelligence assistant.  The assistant gives helpful, detailed, and polite answers to the human's questions.\nUSER: ";
+static const std::string k_user_prompt = "describe the image in detail\nASSISTANT:";
+
+// Logits after the prompt and greedily generated tokens, which are compared across KV cache types
+struct greedy_output
+{
+    std::vector<float> logits;
+    std::vector<std::string> tokens;
+};
+
+// Evaluates the system prompt, image, and user prompt starting from an empty KV cache
+static void eval_prompt(llama_context *ctx_llama, const std::vector<float> &image_embd, int n_img_pos, int n_batch, int *n_past)
+{
+    llama_kv_cache_tokens_rm(ctx_llama, -1, -1);
+    *n_past = 0;
+    llava_eval_string(ctx_llama, k_system_prompt, n_batch, n_past);
+    llava_eval_image_embd(ctx_llama, image_embd.data(), n_img_pos, n_batch, n_past);
+    llava_eval_string(ctx_llama, k_user_prompt, n_batch, n_past);
+}
+
+static void bench_llm(llama_context *ctx_llama, gpt_params &params, const stage_bench_options &options, const std::string &kv_type, const std::vector<float> &image_embd, int n_img_pos, greedy_output &greedy)
+{
+    printf("\nprefill (KV cache %s):\n", kv_type.c_str());
+    const int n_system_tokens = int(::llama_tokenize(ctx_llama, k_system_prompt, true).size());
+    for (int n_batch : options.batch_sizes)
+    {
+        int n_past = 0;
+        auto clear = [&]() { llama_kv_cache_tokens_rm(ctx_llama, -1, -1); n_past = 0; };
+
+        auto string_samples = measure(options, [&]() { llava_eval_string(ctx_llama, k_system_prompt, n_batch, &n_past); }, clear);
+        record("eval_string", { { "kv_type", kv_type }, { "n_batch", n_batch }, { "n_tokens", n_system_tokens } }, string_samples);
+
+        auto image_samples = measure(options, [&]() { llava_eval_image_embd(ctx_llama, image_embd.data(), n_img_pos, n_batch, &n_past); }, clear);
+        record("eval_image_embd", { { "kv_type", kv_type }, { "n_batch", n_batch }, { "n_tokens", n_img_pos } }, image_samples);
+    }
+
+    printf("\nsampling (KV cache %s):\n", kv_type.c_str());
+    {
+        std::vector<double> per_token_ms;
+        for (int rep = 0; rep < options.warmup_repetitions + options.repetitions; rep++)
+        {
+            int n_past = 0;
+            eval_prompt(ctx_llama, image_embd, n_img_pos, params.n_batch, &n_past);
+            for (int i = 0; i < options.sample_tokens; i++)
+            {
+                const int64_t t_start_us = ggml_time_us();
+                llava_sample(ctx_llama, params, &n_past);     // EOS is not special here; we want a fixed token count
+                const int64_t t_end_us = ggml_time_us();
+                if (rep >= options.warmup_repetitions)
+                {
+                    per_token_ms.push_back((t_end_us - t_start_us) / 1000.0);
+                }
+            }
+        }
+        record("sample", { { "kv_type", kv_type }, { "n_tokens_per_repetition", options.sample_tokens } }, per_token_ms);
+    }
+
+    // Greedy sampling, so that any difference in the output comes from the KV cache type
+    gpt_params greedy_params = params;
+    greedy_params.temp = 0;
+    int n_past = 0;
+    eval_prompt(ctx_llama, image_embd, n_img_pos, params.n_batch, &n_past);
+    const float *logits = llama_get_logits(ctx_llama);
+    greedy.logits.assign(logits, logits + llama_n_vocab(llama_get_model(ctx_llama)));
+    for (int i = 0; i < options.quality_tokens; i++)
+    {
+        greedy.tokens.push_back(llava_sample(ctx_llama, greedy_params, &n_past));
+    }
+}
+
+static json compare_greedy(const greedy_output &reference, const greedy_output &output)
+{
+    double sum_sq = 0;
+    double max_abs = 0;
+    for (size_t i = 0; i < reference.logits.size(); i++)
+    {
+        const double diff = double(output.logits[i]) - reference.logits[i];
+        sum_sq += diff * diff;
+        max_abs = std::max(max_abs, std::fabs(diff));
+    }
+    const bool top1_match =
+        std::max_element(reference.logits.begin(), reference.logits.end()) - reference.logits.begin() ==
+        std::max_element(output.logits.begin(), output.logits.end()) - output.logits.begin();
+
+    size_t n_identical = 0;
+    while (n_identical < reference.tokens.size() && n_identical < output.tokens.size() && reference.tokens[n_identical] == output.tokens[n_identical])
+    {
+        n_identical++;
+    }
+
+    return
+    {
+        { "logits_rms_diff", std::sqrt(sum_sq / std::max<size_t>(1, reference.logits.size())) },
+        { "logits_max_abs_diff", max_abs },
+        { "top1_match", top1_match },
+        { "identical_greedy_tokens", n_identical },
+        { "greedy_tokens", reference.tokens.size() }
+    };
+}
+
+int main(int argc, char **argv)
+{
+    ggml_time_init();
+
+    gpt_params params;
+    stage_bench_options options;
+    if (!parse_command_line(argc, argv, params, options) || params.mmproj.empty())
+    {
+        show_additional_info(argc, argv);
+        return 1;
+    }
+    if (options.thread_counts.empty())
+    {
+        for (int n = 1; n < params.n_threads; n *= 2)
+        {
+            options.thread_counts.push_back(n);
+        }
+        options.thread_counts.push_back(params.n_threads);
+    }
+
+    std::vector<bench_input_image> images;
+    if (!load_input_images(options, images))
+    {
+        return 1;
+    }
+
+    clip_ctx *ctx_clip = clip_model_load(params.mmproj.c_str(), /*verbosity=*/ 0);
+    if (!ctx_clip)
+    {
+        fprintf(stderr, "%s: error: unable to load CLIP model\n", __func__);
+        return 1;
+    }
+
+    llama_backend_init(params.numa);
+
+    llama_model_params model_params = llama_model_default_params();
+    llama_model *model = llama_load_model_from_file(params.model.c_str(), model_params);
+    if (model == NULL)
+    {
+        fprintf(stderr, "%s: error: unable to load model\n", __func__);
+        return 1;
+    }
+
+    printf("\nimage decode / preprocess:\n");
+    std::vector<clip_image_f32> preprocessed(images.size());
+    for (size_t i = 0; i < images.size(); i++)
+    {
+        const bench_input_image &image = images[i];
+        clip_image_u8 img = {};
+        bool ok = true;
+        auto decode_samples = measure(options,
+            [&]() { ok = clip_image_load_from_memory(image.data.data(), image.data.size(), &img) && ok; },
+            [&]() { free_image_data(&img); });
+        if (!ok)
+        {
+            fprintf(stderr, "error: unable to decode %s\n", image.name.c_str());
+            return 1;
+        }
+        json config = { { "image", image.name }, { "bytes", image.data.size() }, { "nx", img.nx }, { "ny", img.ny } };
+        record("image_decode", config, decode_samples);
+
+        auto preprocess_samples = measure(options,
+            [&]() { clip_image_preprocess(ctx_clip, &img, &preprocessed[i], /*pad2square =*/ true); },
+            [&]() { free_image_data(&preprocessed[i]); });
+        record("preprocess", config, preprocess_samples);
+        free_image_data(&img);
+    }
+
+    const int n_img_pos = clip_n_patches(ctx_clip);
+    std::vector<float> image_embd(clip_embd_nbytes(ctx_clip) / sizeof(float));
+
+    printf("\nCLIP encode:\n");
+    for (int n_threads : options.thread_counts)
+    {
+        auto samples = measure(options, [&]() { clip_image_encode(ctx_clip, n_threads, &preprocessed[0], image_embd.data()); });
+        record("clip_encode", { { "n_threads", n_threads } }, samples);
+    }
+
+    // image_embd now holds the original mmproj's embedding of the first image, the reference for
+    // the quantized ones
+    json mmproj_results = json::array();
+    for (const std::string &type : options.mmproj_quant_types)
+    {
+        const std::string path = mmproj_quantized_path(params.mmproj, type, options.mmproj_cache_dir);
+        clip_ctx *ctx_quant = path.empty() ? nullptr : clip_model_load(path.c_str(), /*verbosity=*/ 0);
+        if (!ctx_quant)
+        {
+            fprintf(stderr, "%s: error: unable to load the %s mmproj\n", __func__, type.c_str());
+            return 1;
+        }
+
+        printf("\nCLIP encode (mmproj %s):\n", type.c_str());
+        std::vector<float> quant_embd(image_embd.size());
+        for (int n_threads : options.thread_counts)
+        {
+            auto samples = measure(options, [&]() { clip_image_encode(ctx_quant, n_threads, &preprocessed[0], quant_embd.data()); });
+            record("clip_encode", { { "mmproj", type }, { "n_threads", n_threads } }, samples);
+        }
+
+        const json drift = embedding_drift(image_embd, quant_embd, clip_n_mmproj_embd(ctx_clip));
+        printf("\nembedding drift of mmproj %s: %s\n", type.c_str(), drift.dump().c_str());
+        mmproj_results.push_back({ { "type", type }, { "path", path }, { "drift", drift } });
+        clip_free(ctx_quant);
+    }
+
+    if (clip_n_mmproj_embd(ctx_clip) != llama_n_embd(model))
+    {
+        fprintf(stderr, "error: embedding dim of the multimodal projector does not match the model\n");
+        return 1;
+    }
+
+    const int max_batch = *std::max_element(options.batch_sizes.begin(), options.batch_sizes.end());
+    if (options.kv_types.empty())
+    {
+        options.kv_types.push_back(params.memory_f16 ? "f16" : "f32");
+    }
+
+    json kv_results = json::array();
+    greedy_output reference;
+    for (size_t i = 0; i < options.kv_types.size(); i++)
+    {
+        const std::string &kv_type = options.kv_types[i];
+
+        llama_context_params ctx_params = llama_context_default_params();
+        ctx_params.n_ctx           = params.n_ctx < 2048 ? 2048 : params.n_ctx;
+        ctx_params.n_batch         = uint32_t(std::max(max_batch, params.n_batch));
+        ctx_params.f16_kv          = kv_type == "f16";
+        ctx_params.n_threads       = params.n_threads;
+        ctx_params.n_threads_batch = params.n_threads_batch == -1 ? params.n_threads : params.n_threads_batch;
+        llama_context *ctx_llama = llama_new_context_with_model(model, ctx_params);
+        if (ctx_llama == NULL)
+        {
+            fprintf(stderr, "%s: error: failed to create the llama_context\n", __func__);
+            return 1;
+        }
+
+        // The state size is dominated by the KV cache
+        const int n_ctx = llama_n_ctx(ctx_llama);
+        const size_t kv_bytes = llama_get_state_size(ctx_llama);
+        printf("\nKV cache %s: %.1f MiB for %d tokens (%.1f KiB per token)\n", kv_type.c_str(), kv_bytes / (1024.0 * 1024.0), n_ctx, kv_bytes / 1024.0 / n_ctx);
+
+        greedy_output greedy;
+        bench_llm(ctx_llama, params, options, kv_type, image_embd, n_img_pos, greedy);
+        llama_free(ctx_llama);
+
+        json kv = { { "kv_type", kv_type }, { "n_ctx", n_ctx }, { "kv_bytes", kv_bytes } };
+        if (i == 0)
+        {
+            reference = greedy;
+        }
+        else
+        {
+            kv["quality"] = compare_greedy(reference, greedy);
+            printf("\nquality of KV cache %s vs. %s: %s\n", kv_type.c_str(), options.kv_types[0].c_str(), kv["quality"].dump().c_str());
+        }
+        kv_results.push_back(kv);
+    }
+
+    for (clip_image_f32 &img : preprocessed)
+    {
+        free_image_data(&img);
+    }
+
+    if (!options.output_file.empty())
+    {
+        json out =
+        {
+            { "model", params.model },
+            { "mmproj", params.mmproj },
+            { "n_threads", params.n_threads },
+            { "repetitions", options.repetitions },
+            { "warmup_repetitions", options.warmup_repetitions },
+            { "mmproj_quant", mmproj_results },
+            { "kv_cache", kv_results },
+            { "results", results }
+        };
+        std::ofstream file(options.output_file);
+        file << out.dump(2) << std::endl;
+        printf("\nresults written to %s\n", options.output_file.c_str());
+    }
+
+    llama_free_model(model);
+    clip_free(ctx_clip);
+    llama_backend_free();
+
+    return 0;
+}
@@ -0,0 +1,317 @@
+/*
+ * memory_accounting.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Per-component memory accounting. Counters are atomics so that they can be updated from the
+ * inference path and read by the report at any time. Mapped and resident sizes of registered
+ * files are summed over all of their mappings in /proc/self/smaps (Linux only; elsewhere they are
+ * reported as 0).
+ */
+
+#include "memory_accounting.hpp"
+
+#include <atomic>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+static constexpr size_t k_num_components = size_t(memory_component::num_components);
+
+static const char *k_component_names[k_num_components] =
+{
+    "model_weights",
+    "kv_cache",
+    "clip",
+    "embd_cache",
+    "session_store",
+    "buffer_pools",
+    "inflight_payloads"
+};
+
+struct mapping_usage
+{
+    int64_t mapped_bytes = 0;
+    int64_t resident_bytes = 0;
+};
+
+static std::atomic<int64_t> s_allocated[k_num_components];
+static std::atomic<int64_t> s_used[k_num_components];
+static std::atomic<bool> s_has_used[k_num_components];         // otherwise, used is the same as allocated
+static std::atomic<int64_t> s_budget[k_num_components];
+static std::mutex s_files_mutex;
+static std::vector<std::pair<memory_component, std::string>> s_files;    // (component, canonical path)
+struct slot_bytes
+{
+    int64_t kv = 0;
+    int64_t compute = 0;
+    int64_t buffer = 0;
+
+    int64_t total() const { return kv + compute + buffer; }
+};
+
+static std::mutex s_slot_mutex;
+static std::map<int, slot_bytes> s_slots;
+static int s_next_slot_id = 0;
+
+static std::atomic<int64_t> &slot(std::atomic<int64_t> *array, memory_component component)
+{
+    return array[size_t(component)];
+}
+
+void memory_set_allocated(memory_component component, int64_t bytes)
+{
+    slot(s_allocated, component).store(bytes, std::memory_order_relaxed);
+}
+
+void memory_add_allocated(memory_component component, int64_t delta)
+{
+    slot(s_allocated, component).fetch_add(delta, std::memory_order_relaxed);
+}
+
+int64_t memory_allocated(memory_component component)
+{
+    return slot(s_allocated, component).load(std::memory_order_relaxed);
+}
+
+void memory_add_used(memory_component component, int64_t delta)
+{
+    slot(s_used, component).fetch_add(delta, std::memory_order_relaxed);
+    s_has_used[size_t(component)].store(true, std::memory_order_relaxed);
+}
+
+void memory_set_budget(memory_component component, int64_t bytes)
+{
+    slot(s_budget, component).store(bytes, std::memory_order_relaxed);
+}
+
+int64_t memory_budget(memory_component component)
+{
+    return slot(s_budget, component).load(std::memory_order_relaxed);
+}
+
+bool memory_try_reserve(memory_component component, int64_t bytes)
+{
+    const int64_t budget = memory_budget(component);
+    std::atomic<int64_t> &allocated = slot(s_allocated, component);
+    int64_t current = allocated.load(std::memory_order_relaxed);
+    do
+    {
+        if (budget > 0 && current + bytes > budget)
+        {
+            return false;
+        }
+    } while (!allocated.compare_exchange_weak(current, current + bytes, std::memory_order_relaxed));
+    return true;
+}
+
+void memory_release(memory_component component, int64_t bytes)
+{
+    memory_add_allocated(component, -bytes);
+}
+
+static std::string canonical_path(const std::string &path)
+{
+    char resolved[PATH_MAX];
+    return realpath(path.c_str(), resolved) ? std::string(resolved) : path;
+}
+
+void memory_register_file(memory_component component, const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(s_files_mutex);
+    s_files.emplace_back(component, canonical_path(path));
+}
+
+void memory_unregister_file(const std::string &path)
+{
+    const std::string canonical = canonical_path(path);
+    std::lock_guard<std::mutex> lock(s_files_mutex);
+    for (auto it = s_files.begin(); it != s_files.end(); ++it)
+    {
+        if (it->second == canonical)
+        {
+            s_files.erase(it);
+            return;
+        }
+    }
+}
+
+// Sums the mappings of each file. A mapping's header line is followed by attribute lines of the
+// form "Rss:  1234 kB".
+static std::vector<mapping_usage> read_file_mappings(const std::vector<std::string> &paths)
+{
+    std::vector<mapping_usage> usage(paths.size());
+
+    FILE *fp = fopen("/proc/self/smaps", "r");
+    if (!fp)
+    {
+        return usage;
+    }
+
+    char line[4096];
+    int current = -1;   // index of the path the current mapping belongs to
+    while (fgets(line, sizeof(line), fp))
+    {
+        const char *colon = strchr(line, ':');
+        const char *space = strchr(line, ' ');
+        const bool is_attribute = colon && (!space || colon < space);
+        if (!is_attribute)
+        {
+            current = -1;
+            const char *path = strchr(line, '/');
+            if (path)
+            {
+                std::string mapped_path(path);
+                while (!mapped_path.empty() && (mapped_path.back() == '\n' || mapped_path.back() == ' '))
+                {
+                    mapped_path.pop_back();
+                }
+                for (size_t i = 0; i < paths.size(); i++)
+                {
+                    if (paths[i] == mapped_path)
+                    {
+                        current = int(i);
+                        break;
+                    }
+                }
+            }
+        }
+        else if (current >= 0)
+        {
+            long long kb = 0;
+            if (sscanf(line, "Size: %lld kB", &kb) == 1)
+            {
+                usage[current].mapped_bytes += kb * 1024;
+            }
+            else if (sscanf(line, "Rss: %lld kB", &kb) == 1)
+            {
+                usage[current].resident_bytes += kb * 1024;
+            }
+        }
+    }
+
+    fclose(fp);
+    return usage;
+}
+
+// Reads a "<field>: <n> kB" line of a /proc file, in bytes
+static int64_t read_proc_kb(const char *filename, const char *field)
+{
+    FILE *fp = fopen(filename, "r");
+    if (!fp)
+    {
+        return 0;
+    }
+
+    char line[256];
+    const size_t field_len = strlen(field);
+    long long kb = 0;
+    while (fgets(line, sizeof(line), fp))
+    {
+        if (!strncmp(line, field, field_len) && line[field_len] == ':' && sscanf(line + field_len + 1, " %lld kB", &kb) == 1)
+        {
+            break;
+        }
+    }
+
+    fclose(fp);
+    return kb * 1024;
+}
+
+int memory_add_slot(int64_t kv_bytes, int64_t compute_bytes, int64_t buffer_bytes)
+{
+    std::lock_guard<std::mutex> lock(s_slot_mutex);
+    const int id = s_next_slot_id++;
+    s_slots[id] = { kv_bytes, compute_bytes, buffer_bytes };
+    return id;
+}
+
+void memory_remove_slot(int id)
+{
+    std::lock_guard<std::mutex> lock(s_slot_mutex);
+    s_slots.erase(id);
+}
+
+int64_t memory_process_rss()
+{
+    return read_proc_kb("/proc/self/status", "VmRSS");
+}
+
+std::string memory_report_json()
+{
+    std::vector<std::pair<memory_component, std::string>> files;
+    {
+        std::lock_guard<std::mutex> lock(s_files_mutex);
+        files = s_files;
+    }
+    std::vector<std::string> paths;
+    for (auto &file : files)
+    {
+        paths.emplace_back(file.second);
+    }
+    std::vector<mapping_usage> mappings = read_file_mappings(paths);
+
+    char buf[512];
+    snprintf(buf, sizeof(buf), "{\"process_rss_bytes\": %lld, \"components\": {", (long long) memory_process_rss());
+    std::string json(buf);
+
+    int64_t total_accounted = 0;
+    for (size_t i = 0; i < k_num_components; i++)
+    {
+        const memory_component component = memory_component(i);
+        const int64_t allocated = memory_allocated(component);
+        const int64_t used = s_has_used[i] ? slot(s_used, component).load(std::memory_order_relaxed) : allocated;
+
+        mapping_usage mapped;
+        for (size_t j = 0; j < files.size(); j++)
+        {
+            if (files[j].first == component)
+            {
+                mapped.mapped_bytes += mappings[j].mapped_bytes;
+                mapped.resident_bytes += mappings[j].resident_bytes;
+            }
+        }
+
+        // Mapped files count towards the total by their resident size
+        total_accounted += allocated + mapped.resident_bytes;
+
+        snprintf(buf, sizeof(buf),
+            "%s\"%s\": {\"allocated_bytes\": %lld, \"used_bytes\": %lld, \"budget_bytes\": %lld, \"mapped_bytes\": %lld, \"resident_bytes\": %lld}",
+            i == 0 ? "" : ", ", k_component_names[i], (long long) allocated, (long long) used,
+            (long long) memory_budget(component), (long long) mapped.mapped_bytes, (long long) mapped.resident_bytes);
+        json += buf;
+    }
+
+    // Memory actually backed by huge pages, transparent and explicit
+    snprintf(buf, sizeof(buf), "}, \"total_accounted_bytes\": %lld, \"huge_pages\": {\"transparent_bytes\": %lld, \"explicit_bytes\": %lld}",
+        (long long) total_accounted, (long long) read_proc_kb("/proc/self/smaps_rollup", "AnonHugePages"),
+        (long long) read_proc_kb("/proc/self/status", "HugetlbPages"));
+    json += buf;
+
+    // How many more slots of the largest size loaded would fit in available memory
+    slot_bytes largest;
+    size_t n_slots;
+    {
+        std::lock_guard<std::mutex> lock(s_slot_mutex);
+        for (auto &[id, slot] : s_slots)
+        {
+            if (slot.total() > largest.total())
+            {
+                largest = slot;
+            }
+        }
+        n_slots = s_slots.size();
+    }
+    const int64_t available = read_proc_kb("/proc/meminfo", "MemAvailable");
+    snprintf(buf, sizeof(buf),
+        ", \"slot\": {\"loaded_slots\": %zu, \"kv_bytes\": %lld, \"compute_bytes\": %lld, \"buffer_bytes\": %lld, \"total_bytes\": %lld, \"available_bytes\": %lld, \"additional_slots\": %lld}}",
+        n_slots, (long long) largest.kv, (long long) largest.compute, (long long) largest.buffer, (long long) largest.total(),
+        (long long) available, (long long) (largest.total() > 0 ? available / largest.total() : 0));
+    json += buf;
+    return json;
+}
@@ -0,0 +1,63 @@
+/*
+ * memory_accounting.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Per-component memory accounting and budgets, reported on the /debug/memory endpoint. Components
+ * report how much they have allocated (and, where it differs, how much of that is in use). Files
+ * that are mmapped can be registered so that their mapped and resident sizes are read from
+ * /proc/self/smaps when the report is generated.
+ */
+
+#pragma once
+#ifndef INCLUDED_MEMORY_ACCOUNTING_HPP
+#define INCLUDED_MEMORY_ACCOUNTING_HPP
+
+#include <cstdint>
+#include <string>
+
+enum class memory_component
+{
+    model_weights,
+    kv_cache,
+    clip,
+    embd_cache,
+    session_store,
+    buffer_pools,
+    inflight_payloads,
+    num_components
+};
+
+void memory_set_allocated(memory_component component, int64_t bytes);
+void memory_add_allocated(memory_component component, int64_t delta);
+int64_t memory_allocated(memory_component component);
+
+// For components that allocate up front and fill over time (e.g., the KV cache). Each instance
+// adds the change in its own usage, so that usage is summed over instances.
+void memory_add_used(memory_component component, int64_t delta);
+
+// A budget of 0 means no budget has been configured. Caches are disabled without a budget, while
+// admission control is unlimited.
+void memory_set_budget(memory_component component, int64_t bytes);
+int64_t memory_budget(memory_component component);
+
+// Adds bytes to a component's allocation unless doing so would exceed its budget
+bool memory_try_reserve(memory_component component, int64_t bytes);
+void memory_release(memory_component component, int64_t bytes);
+
+// Registers a file whose mappings are attributed to a component
+void memory_register_file(memory_component component, const std::string &path);
+void memory_unregister_file(const std::string &path);
+
+// Memory needed per inference slot (a llama context: its KV cache, compute buffer, and our
+// buffers), reported with the memory still available so that the number of slots can be sized
+// against it. Each loaded context registers its slot, and unregisters it with the returned id when
+// it is freed. The largest slot currently registered is reported.
+int memory_add_slot(int64_t kv_bytes, int64_t compute_bytes, int64_t buffer_bytes);
+void memory_remove_slot(int id);
+
+// Resident set size of the whole process, in bytes
+int64_t memory_process_rss();
+
+std::string memory_report_json();
+
+#endif  // INCLUDED_MEMORY_ACCOUNTING_HPP
@@ -0,0 +1,236 @@
+/*
+ * metrics.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Server metrics. Every thread that records a metric gets its own shard of atomics, registered
+ * once in a global list. Recording touches only the calling thread's shard (relaxed atomics, no
+ * locks, no shared cache lines) and the scraper sums all shards when rendering. Gauges are
+ * process-wide values rather than sums, so they are kept as single atomics.
+ */
+
+#include "metrics.hpp"
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+static constexpr size_t k_num_stages = size_t(metric_stage::num_stages);
+static constexpr size_t k_num_counters = size_t(metric_counter::num_counters);
+static constexpr size_t k_num_gauges = size_t(metric_gauge::num_gauges);
+
+// Histogram bucket upper bounds (microseconds). A final implicit +Inf bucket follows.
+static constexpr int64_t k_bucket_bounds_us[] =
+{
+    1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+    1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+static constexpr size_t k_num_buckets = sizeof(k_bucket_bounds_us) / sizeof(k_bucket_bounds_us[0]) + 1;
+
+struct histogram_shard
+{
+    std::atomic<uint64_t> buckets[k_num_buckets];   // non-cumulative counts
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_us;
+};
+
+struct alignas(64) metrics_shard
+{
+    histogram_shard histograms[k_num_stages];
+    std::atomic<uint64_t> counters[k_num_counters];
+};
+
+struct metric_info
+{
+    const char *name;
+    const char *help;
+};
+
+static const metric_info k_stage_info[k_num_stages] =
+{
+    { "llava_queue_wait_seconds",           "Time spent waiting for the inference context" },
+    { "llava_image_decode_seconds",         "Time spent decoding the uploaded image" },
+    { "llava_preprocess_seconds",           "Time spent preprocessing the image for CLIP" },
+    { "llava_clip_encode_seconds",          "Time spent encoding the image with CLIP" },
+    { "llava_prompt_prefill_seconds",       "Time spent evaluating the prompt and image embeddings" },
+    { "llava_time_to_first_token_seconds",  "Time from request hand-off to the first generated token" },
+    { "llava_inter_token_seconds",          "Time between consecutive generated tokens" },
+    { "llava_request_duration_seconds",     "Total time from request hand-off to response" }
+};
+
+static const metric_info k_counter_info[k_num_counters] =
+{
+    { "llava_requests_total",           "Inference requests handed off" },
+    { "llava_tokens_generated_total",   "Tokens generated" },
+    { "llava_cache_hits_total",         "Cache hits" },
+    { "llava_context_shifts_total",     "Times generation filled the context and its oldest text was discarded" },
+    { "llava_prompt_truncations_total", "Prompts whose oldest text was discarded to fit the context" },
+    { "llava_errors_total",             "Requests that failed with an error response" }
+};
+
+static const metric_info k_gauge_info[k_num_gauges] =
+{
+    { "llava_queue_depth",      "Requests waiting for the inference context" },
+    { "llava_active_slots",     "Requests currently being processed" }
+};
+
+static std::mutex s_shards_mutex;   // guards registration and scraping only, never recording
+static std::vector<std::unique_ptr<metrics_shard>> s_shards;    // shards outlive their threads
+static std::atomic<int64_t> s_gauges[k_num_gauges];
+
+static metrics_shard *this_thread_shard()
+{
+    thread_local metrics_shard *shard = nullptr;
+    if (!shard)
+    {
+        auto new_shard = std::make_unique<metrics_shard>();    // value-initialized, i.e., zeroed
+        shard = new_shard.get();
+        std::lock_guard<std::mutex> lock(s_shards_mutex);
+        s_shards.emplace_back(std::move(new_shard));
+    }
+    return shard;
+}
+
+static thread_local bool t_suppressed = false;
+
+metrics_suppressed::metrics_suppressed()
+    : m_previous(t_suppressed)
+{
+    t_suppressed = true;
+}
+
+metrics_suppressed::~metrics_suppressed()
+{
+    t_suppressed = m_previous;
+}
+
+bool metrics_suppressed::active()
+{
+    return t_suppressed;
+}
+
+void metrics_observe(metric_stage stage, int64_t duration_us)
+{
+    if (t_suppressed)
+    {
+        return;
+    }
+    if (duration_us < 0)
+    {
+        duration_us = 0;
+    }
+
+    size_t bucket = 0;
+    while (bucket < k_num_buckets - 1 && duration_us > k_bucket_bounds_us[bucket])
+    {
+        bucket++;
+    }
+
+    histogram_shard &histogram = this_thread_shard()->histograms[size_t(stage)];
+    histogram.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    histogram.count.fetch_add(1, std::memory_order_relaxed);
+    histogram.sum_us.fetch_add(uint64_t(duration_us), std::memory_order_relaxed);
+}
+
+void metrics_increment(metric_counter counter, uint64_t amount)
+{
+    if (t_suppressed)
+    {
+        return;
+    }
+    this_thread_shard()->counters[size_t(counter)].fetch_add(amount, std::memory_order_relaxed);
+}
+
+void metrics_gauge_add(metric_gauge gauge, int64_t delta)
+{
+    s_gauges[size_t(gauge)].fetch_add(delta, std::memory_order_relaxed);
+}
+
+int64_t metrics_gauge_value(metric_gauge gauge)
+{
+    return s_gauges[size_t(gauge)].load(std::memory_order_relaxed);
+}
+
+static void append(std::string &s, const char *format, ...)
+{
+    char buf[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(buf, sizeof(buf), format, args);
+    va_end(args);
+    s += buf;
+}
+
+std::string metrics_prometheus_text()
+{
+    uint64_t buckets[k_num_stages][k_num_buckets] = {};
+    uint64_t counts[k_num_stages] = {};
+    uint64_t sums_us[k_num_stages] = {};
+    uint64_t counters[k_num_counters] = {};
+
+    {
+        std::lock_guard<std::mutex> lock(s_shards_mutex);
+        for (auto &shard : s_shards)
+        {
+            for (size_t i = 0; i < k_num_stages; i++)
+            {
+                const histogram_shard &histogram = shard->histograms[i];
+                for (size_t j = 0; j < k_num_buckets; j++)
+                {
+                    buckets[i][j] += histogram.buckets[j].load(std::memory_order_relaxed);
+                }
+                counts[i] += histogram.count.load(std::memory_order_relaxed);
+                sums_us[i] += histogram.sum_us.load(std::memory_order_relaxed);
+            }
+            for (size_t i = 0; i < k_num_counters; i++)
+            {
+                counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    std::string s;
+
+    for (size_t i = 0; i < k_num_stages; i++)
+    {
+        const metric_info &info = k_stage_info[i];
+        append(s, "# HELP %s %s\n", info.name, info.help);
+        append(s, "# TYPE %s histogram\n", info.name);
+        uint64_t cumulative = 0;
+        for (size_t j = 0; j < k_num_buckets; j++)
+        {
+            cumulative += buckets[i][j];
+            if (j < k_num_buckets - 1)
+            {
+                append(s, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", info.name, k_bucket_bounds_us[j] / 1e6, cumulative);
+            }
+            else
+            {
+                append(s, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", info.name, cumulative);
+            }
+        }
+        append(s, "%s_sum %.6f\n", info.name, sums_us[i] / 1e6);
+        append(s, "%s_count %" PRIu64 "\n", info.name, counts[i]);
+    }
+
+    for (size_t i = 0; i < k_num_counters; i++)
+    {
+        const metric_info &info = k_counter_info[i];
+        append(s, "# HELP %s %s\n", info.name, info.help);
+        append(s, "# TYPE %s counter\n", info.name);
+        append(s, "%s %" PRIu64 "\n", info.name, counters[i]);
+    }
+
+    for (size_t i = 0; i < k_num_gauges; i++)
+    {
+        const metric_info &info = k_gauge_info[i];
+        append(s, "# HELP %s %s\n", info.name, info.help);
+        append(s, "# TYPE %s gauge\n", info.name);
+        append(s, "%s %" PRId64 "\n", info.name, s_gauges[i].load(std::memory_order_relaxed));
+    }
+
+    return s;
+}
@@ -0,0 +1,71 @@
+/*
+ * metrics.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Server metrics: per-stage latency histograms, counters, and gauges. Exposed in Prometheus text
+ * format on the /metrics endpoint.
+ */
+
+#pragma once
+#ifndef INCLUDED_METRICS_HPP
+#define INCLUDED_METRICS_HPP
+
+#include <cstdint>
+#include <string>
+
+enum class metric_stage
+{
+    queue_wait,
+    image_decode,
+    preprocess,
+    clip_encode,
+    prompt_prefill,
+    time_to_first_token,
+    inter_token,
+    total,
+    num_stages
+};
+
+enum class metric_counter
+{
+    requests,
+    tokens_generated,
+    cache_hits,
+    context_shifts,
+    prompt_truncations,
+    errors,
+    num_counters
+};
+
+enum class metric_gauge
+{
+    queue_depth,
+    active_slots,
+    num_gauges
+};
+
+// Recording is lock-free: each thread accumulates into its own shard, which is only summed when
+// metrics are scraped
+void metrics_observe(metric_stage stage, int64_t duration_us);
+void metrics_increment(metric_counter counter, uint64_t amount = 1);
+void metrics_gauge_add(metric_gauge gauge, int64_t delta);
+int64_t metrics_gauge_value(metric_gauge gauge);
+
+// While an instance exists on a thread, histograms and counters recorded on that thread are
+// dropped, e.g., for synthetic warmup requests that must not skew latencies
+class metrics_suppressed
+{
+public:
+    metrics_suppressed();
+    ~metrics_suppressed();
+
+    // True if recording is suppressed on the calling thread
+    static bool active();
+
+private:
+    bool m_previous;
+};
+
+std::string metrics_prometheus_text();
+
+#endif  // INCLUDED_METRICS_HPP
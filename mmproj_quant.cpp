@@ -0,0 +1,189 @@
+/*
+ * mmproj_quant.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * mmproj quantization. Cached files are named "<source name>.<type>.<hash>.gguf", where the hash
+ * is a SHA-256 prefix of the source file's contents, so a replaced source file is quantized afresh.
+ * Hashing a source file means reading all of it, so a sidecar file, "<source name>.<type>.source",
+ * records the source path, its size, modification time, and inode, and the cached file it was
+ * last quantized to. When these still match, the cached file is used without reading the source.
+ * Quantized files are written under a temporary name and renamed into place, so that a server
+ * interrupted while quantizing never leaves a partial file to be loaded by the next one.
+ */
+
+#include "mmproj_quant.hpp"
+#include "sha256.hpp"
+
+#include "llama.cpp/examples/llava/clip.h"
+#include "llama.cpp/ggml.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+// Backends loading the same mmproj concurrently (e.g., NUMA replicas) quantize it once
+static std::mutex s_mtx;
+
+bool parse_mmproj_quant_type(const std::string &name, int &itype)
+{
+    if (name == "q8_0")
+    {
+        itype = GGML_TYPE_Q8_0;
+    }
+    else if (name == "q5_0")
+    {
+        itype = GGML_TYPE_Q5_0;
+    }
+    else if (name == "q5_1")
+    {
+        itype = GGML_TYPE_Q5_1;
+    }
+    else if (name == "q4_0")
+    {
+        itype = GGML_TYPE_Q4_0;
+    }
+    else if (name == "q4_1")
+    {
+        itype = GGML_TYPE_Q4_1;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+static bool hash_file(const std::string &path, std::string &hex)
+{
+    FILE *fp = fopen(path.c_str(), "rb");
+    if (!fp)
+    {
+        return false;
+    }
+
+    sha256 hash;
+    std::vector<uint8_t> buf(1 << 20);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), fp)) > 0)
+    {
+        hash.update(buf.data(), n);
+    }
+
+    const bool ok = !ferror(fp);
+    fclose(fp);
+    hex = sha256::hex(hash.finish()).substr(0, 16);
+    return ok;
+}
+
+// Cheap identity of a file's current contents, which changes whenever the file is rewritten or
+// replaced
+static bool file_stamp(const std::string &path, std::string &stamp)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+    stamp = std::to_string((long long) st.st_size) + " " + std::to_string((long long) st.st_mtime) + " " +
+        std::to_string((unsigned long long) st.st_dev) + ":" + std::to_string((unsigned long long) st.st_ino);
+    return true;
+}
+
+// Returns the cached file recorded in the sidecar if it was quantized from this source file, as
+// last seen with this stamp, and still exists
+static std::string read_sidecar(const std::string &sidecar_path, const std::string &source_path, const std::string &stamp)
+{
+    std::ifstream file(sidecar_path);
+    std::string recorded_source, recorded_stamp, cached_path;
+    if (!std::getline(file, recorded_source) || !std::getline(file, recorded_stamp) || !std::getline(file, cached_path) ||
+        recorded_source != source_path || recorded_stamp != stamp || access(cached_path.c_str(), R_OK) != 0)
+    {
+        return "";
+    }
+    return cached_path;
+}
+
+static void write_sidecar(const std::string &sidecar_path, const std::string &source_path, const std::string &stamp, const std::string &cached_path)
+{
+    const std::string tmp_path = sidecar_path + ".tmp" + std::to_string(getpid());
+    {
+        std::ofstream file(tmp_path);
+        file << source_path << std::endl << stamp << std::endl << cached_path << std::endl;
+        if (!file)
+        {
+            unlink(tmp_path.c_str());
+            return;
+        }
+    }
+    if (rename(tmp_path.c_str(), sidecar_path.c_str()) != 0)
+    {
+        unlink(tmp_path.c_str());
+    }
+}
+
+std::string mmproj_quantized_path(const std::string &mmproj_path, const std::string &type, const std::string &cache_dir)
+{
+    int itype = 0;
+    if (!parse_mmproj_quant_type(type, itype))
+    {
+        fprintf(stderr, "%s: error: unsupported mmproj quantization type: %s\n", __func__, type.c_str());
+        return "";
+    }
+
+    std::string stamp;
+    if (!file_stamp(mmproj_path, stamp))
+    {
+        fprintf(stderr, "%s: error: unable to read %s\n", __func__, mmproj_path.c_str());
+        return "";
+    }
+
+    std::string name = mmproj_path.substr(mmproj_path.find_last_of('/') + 1);
+    if (name.size() > 5 && name.compare(name.size() - 5, 5, ".gguf") == 0)
+    {
+        name.resize(name.size() - 5);
+    }
+    const std::string sidecar_path = cache_dir + "/" + name + "." + type + ".source";
+
+    std::lock_guard<std::mutex> lock(s_mtx);
+    const int64_t t_start_us = ggml_time_us();
+
+    std::string path = read_sidecar(sidecar_path, mmproj_path, stamp);
+    if (!path.empty())
+    {
+        printf("%s: using %s\n", __func__, path.c_str());
+        return path;
+    }
+
+    std::string hex;
+    if (!hash_file(mmproj_path, hex))
+    {
+        fprintf(stderr, "%s: error: unable to read %s\n", __func__, mmproj_path.c_str());
+        return "";
+    }
+    path = cache_dir + "/" + name + "." + type + "." + hex + ".gguf";
+
+    mkdir(cache_dir.c_str(), 0755);
+    if (access(path.c_str(), R_OK) == 0)
+    {
+        write_sidecar(sidecar_path, mmproj_path, stamp, path);
+        printf("%s: using %s\n", __func__, path.c_str());
+        return path;
+    }
+
+    const std::string tmp_path = path + ".tmp" + std::to_string(getpid());
+    if (!clip_model_quantize(mmproj_path.c_str(), tmp_path.c_str(), itype) || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        unlink(tmp_path.c_str());
+        fprintf(stderr, "%s: error: unable to quantize %s to %s\n", __func__, mmproj_path.c_str(), path.c_str());
+        return "";
+    }
+    write_sidecar(sidecar_path, mmproj_path, stamp, path);
+
+    printf("%s: quantized %s to %s in %.2f s\n", __func__, mmproj_path.c_str(), path.c_str(), (ggml_time_us() - t_start_us) / 1e6);
+    return path;
+}
@@ -0,0 +1,24 @@
+/*
+ * mmproj_quant.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Load-time quantization of the mmproj (CLIP) model. mmproj files are usually distributed in f16,
+ * which makes CLIP encode a large share of per-request CPU time. A quantized copy is written to a
+ * cache directory, named after a hash of the source file's contents, so that later starts load it
+ * directly.
+ */
+
+#pragma once
+#ifndef INCLUDED_MMPROJ_QUANT_HPP
+#define INCLUDED_MMPROJ_QUANT_HPP
+
+#include <string>
+
+// Accepts q8_0, q5_0, q5_1, q4_0, and q4_1, returning the corresponding ggml_type
+bool parse_mmproj_quant_type(const std::string &name, int &itype);
+
+// Returns the path of a copy of mmproj_path quantized to type in cache_dir, quantizing it if
+// there is none for the file's current contents yet. Returns an empty string on failure.
+std::string mmproj_quantized_path(const std::string &mmproj_path, const std::string &type, const std::string &cache_dir);
+
+#endif  // INCLUDED_MMPROJ_QUANT_HPP
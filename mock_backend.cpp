@@ -0,0 +1,180 @@
+/*
+ * mock_backend.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Mock inference backend. Each stage sleeps for its configured latency (optionally perturbed by
+ * jitter) and the response is a sequence of words drawn from a fixed vocabulary. Both the jitter
+ * and the words are derived from a hash of the request, so identical requests produce identical
+ * responses and timings.
+ */
+
+#include "mock_backend.hpp"
+
+#include "llama.cpp/ggml.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <thread>
+
+static const char *k_vocabulary[] =
+{
+    " the", " image", " shows", " a", " cat", " sitting", " on", " wooden", " table", " next",
+    " to", " window", " with", " light", " coming", " through", " and", " small", " plant", "."
+};
+
+static uint64_t hash_request(const llava_request &request)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    auto mix = [&hash](const uint8_t *data, size_t size)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            hash ^= data[i];
+            hash *= 0x100000001b3ull;
+        }
+    };
+    mix((const uint8_t *) request.system_prompt.data(), request.system_prompt.size());
+    mix((const uint8_t *) request.user_prompt.data(), request.user_prompt.size());
+    mix(request.image.get(), request.image_buffer_size);
+    return hash;
+}
+
+bool parse_mock_backend_options(const std::string &spec, mock_backend_options &options)
+{
+    size_t pos = 0;
+    while (pos < spec.size())
+    {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+        {
+            end = spec.size();
+        }
+        std::string item = spec.substr(pos, end - pos);
+        pos = end + 1;
+
+        size_t equals = item.find('=');
+        if (equals == std::string::npos)
+        {
+            fprintf(stderr, "error: mock backend option '%s' is not of the form key=value\n", item.c_str());
+            return false;
+        }
+        std::string key = item.substr(0, equals);
+        double value = atof(item.c_str() + equals + 1);
+
+        if (key == "decode")
+        {
+            options.image_decode_us = int64_t(value * 1000);
+        }
+        else if (key == "preprocess")
+        {
+            options.preprocess_us = int64_t(value * 1000);
+        }
+        else if (key == "encode")
+        {
+            options.clip_encode_us = int64_t(value * 1000);
+        }
+        else if (key == "prefill")
+        {
+            options.prompt_prefill_us = int64_t(value * 1000);
+        }
+        else if (key == "token")
+        {
+            options.token_us = int64_t(value * 1000);
+        }
+        else if (key == "tokens")
+        {
+            options.n_tokens = int(value);
+        }
+        else if (key == "jitter")
+        {
+            options.jitter = value;
+        }
+        else
+        {
+            fprintf(stderr, "error: unknown mock backend option '%s'\n", key.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Sleeps for a stage's latency and returns the time at which it ended
+static int64_t simulate(std::mt19937_64 &rng, std::uniform_real_distribution<double> &jitter, int64_t latency_us)
+{
+    int64_t us = int64_t(latency_us * (1.0 + jitter(rng)));
+    std::this_thread::sleep_for(std::chrono::microseconds(us > 0 ? us : 0));
+    return ggml_time_us();
+}
+
+mock_backend::mock_backend(const mock_backend_options &options)
+    : m_options(options)
+{
+}
+
+std::unique_ptr<prepared_input> mock_backend::prepare(
+    const llava_request &request,
+    httplib::Response &web_response,
+    inference_timings &timings
+)
+{
+    std::mt19937_64 rng(hash_request(request) ^ 1);
+    std::uniform_real_distribution<double> jitter(-m_options.jitter, m_options.jitter);
+
+    if (request.image_buffer_size == 0)
+    {
+        set_error_response(web_response, "unable to load image");
+        return nullptr;
+    }
+
+    const int64_t t_img_dec_start_us = ggml_time_us();
+    const int64_t t_img_dec_end_us = simulate(rng, jitter, m_options.image_decode_us);
+    timings.image_decode_us = record_stage(metric_stage::image_decode, "image_decode", t_img_dec_start_us, t_img_dec_end_us);
+
+    const int64_t t_img_pre_end_us = simulate(rng, jitter, m_options.preprocess_us);
+    timings.preprocess_us = record_stage(metric_stage::preprocess, "preprocess", t_img_dec_end_us, t_img_pre_end_us);
+
+    return std::make_unique<prepared_input>();
+}
+
+void mock_backend::perform_inference(
+    const llava_request &request,
+    prepared_input & /*input*/,
+    httplib::Response &web_response,
+    int64_t t_hand_off_us,
+    inference_timings &timings
+)
+{
+    std::mt19937_64 rng(hash_request(request));
+    std::uniform_real_distribution<double> jitter(-m_options.jitter, m_options.jitter);
+
+    const int64_t t_img_enc_start_us = ggml_time_us();
+    const int64_t t_img_enc_end_us = simulate(rng, jitter, m_options.clip_encode_us);
+    timings.clip_encode_us = record_stage(metric_stage::clip_encode, "clip_encode", t_img_enc_start_us, t_img_enc_end_us);
+
+    const int64_t t_prefill_end_us = simulate(rng, jitter, m_options.prompt_prefill_us);
+    timings.prompt_prefill_us = record_stage(metric_stage::prompt_prefill, "prompt_prefill", t_img_enc_end_us, t_prefill_end_us);
+    // Roughly 4 characters per token for the text portion of the prompt
+    timings.n_prompt_tokens = m_options.n_image_tokens + int(request.system_prompt.size() + request.user_prompt.size()) / 4;
+
+    const size_t vocabulary_size = sizeof(k_vocabulary) / sizeof(k_vocabulary[0]);
+    std::string output;
+    int64_t t_last_token_us = t_prefill_end_us;
+    const int n_tokens = request.n_predict >= 0 ? request.n_predict : m_options.n_tokens;
+    for (int i = 0; i < n_tokens; i++)
+    {
+        if (drain_deadline_passed(web_response))
+        {
+            return;
+        }
+        const int64_t t_token_us = simulate(rng, jitter, m_options.token_us);
+        record_token(timings, i == 0, t_hand_off_us, t_last_token_us, t_token_us);
+        t_last_token_us = t_token_us;
+
+        count_generated_token(timings, t_hand_off_us, t_token_us);
+        output += k_vocabulary[rng() % vocabulary_size];
+    }
+
+    set_success_response(web_response, output, timings, t_hand_off_us, t_prefill_end_us);
+}
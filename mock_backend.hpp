@@ -0,0 +1,59 @@
+/*
+ * mock_backend.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Inference backend that requires no models. It simulates configurable stage latencies and
+ * produces a deterministic token stream for each request, so the HTTP front end, queueing, and
+ * instrumentation can be load tested and profiled on any machine.
+ */
+
+#pragma once
+#ifndef INCLUDED_MOCK_BACKEND_HPP
+#define INCLUDED_MOCK_BACKEND_HPP
+
+#include "inference_backend.hpp"
+
+#include <cstdint>
+#include <string>
+
+struct mock_backend_options
+{
+    int64_t image_decode_us = 5000;
+    int64_t preprocess_us = 10000;
+    int64_t clip_encode_us = 300000;
+    int64_t prompt_prefill_us = 400000;
+    int64_t token_us = 30000;
+    int n_tokens = 64;
+    int n_image_tokens = 576;
+    double jitter = 0.0;            // each latency varies by up to +/- this fraction
+};
+
+// Parses a comma-separated list of key=value pairs. Latencies are in milliseconds:
+// decode, preprocess, encode, prefill, token. Also: tokens (count), jitter (fraction).
+bool parse_mock_backend_options(const std::string &spec, mock_backend_options &options);
+
+class mock_backend : public inference_backend
+{
+public:
+    mock_backend(const mock_backend_options &options);
+
+    // Simulates image decoding and preprocessing
+    std::unique_ptr<prepared_input> prepare(
+        const llava_request &request,
+        httplib::Response &web_response,
+        inference_timings &timings
+    ) override;
+
+    void perform_inference(
+        const llava_request &request,
+        prepared_input &input,
+        httplib::Response &web_response,
+        int64_t t_hand_off_us,
+        inference_timings &timings
+    ) override;
+
+private:
+    mock_backend_options m_options;
+};
+
+#endif  // INCLUDED_MOCK_BACKEND_HPP
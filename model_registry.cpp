@@ -0,0 +1,276 @@
+/*
+ * model_registry.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Registry of named models. Resident memory is estimated from file sizes: each resident model
+ * counts its GGUF file, and each distinct mmproj file is counted once because backends share
+ * CLIP contexts. Replicated models hold every file once per replica. On top of
+ * that, each model counts the KV cache and buffers its backend reported when it was loaded, and
+ * models that have not been loaded yet are assumed to need as much as the largest loaded one.
+ * Evicted models keep counting until they have been freed, and a model being loaded counts from
+ * the moment room was made for it, so that concurrent loads cannot overcommit the budget.
+ */
+
+#include "model_registry.hpp"
+#include "web_server.hpp"
+
+#include "llama.cpp/ggml.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <set>
+
+static int64_t file_size(const std::string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 ? int64_t(st.st_size) : 0;
+}
+
+model_registry::model_registry(loader load, int64_t budget_bytes, int copies_per_model)
+    : m_load(load),
+      m_budget_bytes(budget_bytes),
+      m_copies_per_model(copies_per_model)
+{
+}
+
+void model_registry::set_files(entry *e, const model_files &files)
+{
+    e->files = files;
+    e->model_bytes = file_size(files.model_path);
+    e->mmproj_bytes = file_size(files.mmproj_path);
+}
+
+void model_registry::add(const std::string &name, const model_files &files)
+{
+    auto e = std::make_unique<entry>();
+    e->name = name;
+    set_files(e.get(), files);
+
+    std::lock_guard<std::mutex> lock(m_mtx);
+    m_entries.emplace_back(std::move(e));
+}
+
+model_registry::entry *model_registry::find(const std::string &name) const
+{
+    for (auto &e : m_entries)
+    {
+        if (e->name == name)
+        {
+            return e.get();
+        }
+    }
+    return nullptr;
+}
+
+bool model_registry::contains(const std::string &name) const
+{
+    return find(name) != nullptr;
+}
+
+bool model_registry::files(const std::string &name, model_files &files) const
+{
+    entry *e = find(name);
+    if (!e)
+    {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(m_mtx);
+    files = e->files;
+    return true;
+}
+
+void model_registry::touch(entry *e)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    e->last_used_us = ggml_time_us();
+}
+
+int64_t model_registry::resident_bytes_with(const entry *e) const
+{
+    int64_t file_bytes = 0;
+    int64_t context_bytes = m_freeing_bytes;
+    std::set<std::string> mmprojs;
+    for (auto &r : m_entries)
+    {
+        const bool resident = r->slot.current() != nullptr;
+        if (r.get() == e || resident || r->loading)
+        {
+            file_bytes += r->model_bytes;
+            if (mmprojs.insert(r->files.mmproj_path).second)
+            {
+                file_bytes += r->mmproj_bytes;
+            }
+            context_bytes += resident || r->context_bytes > 0 ? r->context_bytes : m_context_estimate;
+        }
+    }
+    return file_bytes * m_copies_per_model + context_bytes;
+}
+
+void model_registry::make_room_for(entry *e)
+{
+    // Evicted backends are freed after the lock is dropped, once the requests they are processing
+    // have finished, which takes a while. The caller loads its model only after that. Until then,
+    // the evicted bytes still count for everyone else, but not against this model, which frees
+    // them before it is loaded.
+    std::vector<std::shared_ptr<active_backend>> evicted;
+    int64_t evicted_bytes = 0;
+    {
+        std::unique_lock<std::mutex> lock(m_mtx);
+        while (m_budget_bytes > 0 && resident_bytes_with(e) - evicted_bytes > m_budget_bytes)
+        {
+            entry *victim = nullptr;
+            bool other_loads = false;
+            for (auto &r : m_entries)
+            {
+                if (r.get() != e && r->slot.current() && (!victim || r->last_used_us < victim->last_used_us))
+                {
+                    victim = r.get();
+                }
+                other_loads = other_loads || (r.get() != e && r->loading);
+            }
+            if (!victim && other_loads)
+            {
+                // Models being loaded cannot be evicted until they are resident
+                m_loaded_cv.wait(lock);
+                continue;
+            }
+            if (!victim)
+            {
+                break;
+            }
+            printf("%s: evicting model %s to make room for %s\n", __func__, victim->name.c_str(), e->name.c_str());
+            const int64_t resident_bytes = resident_bytes_with(e);
+            evicted.emplace_back(victim->slot.replace(nullptr));
+            const int64_t freed_bytes = resident_bytes - resident_bytes_with(e);
+            m_freeing_bytes += freed_bytes;
+            evicted_bytes += freed_bytes;
+        }
+        e->loading = true;
+    }
+
+    for (std::shared_ptr<active_backend> &backend : evicted)
+    {
+        backend_slot::free_when_released(std::move(backend));
+    }
+    if (!evicted.empty())
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_freeing_bytes -= evicted_bytes;
+    }
+}
+
+std::shared_ptr<active_backend> model_registry::finish_loading(entry *e, std::shared_ptr<active_backend> backend)
+{
+    std::shared_ptr<active_backend> lease;
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        if (backend)
+        {
+            e->slot.replace(std::move(backend));
+            lease = e->slot.current();
+        }
+        e->loading = false;
+    }
+    m_loaded_cv.notify_all();
+    return lease;
+}
+
+void model_registry::set_loaded(entry *e, const std::shared_ptr<active_backend> &backend)
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    e->context_bytes = backend->backend->context_bytes();
+    m_context_estimate = std::max(m_context_estimate, e->context_bytes);
+}
+
+std::shared_ptr<active_backend> model_registry::acquire(const std::string &name)
+{
+    entry *e = find(name);
+    if (!e)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<active_backend> backend = e->slot.current();
+    if (!backend)
+    {
+        // Requests for a model that is being loaded wait here for it
+        std::lock_guard<std::mutex> load_lock(e->load_mtx);
+        backend = e->slot.current();
+        if (!backend)
+        {
+            model_files model;
+            files(name, model);
+
+            make_room_for(e);
+            printf("%s: loading model %s\n", __func__, name.c_str());
+            std::shared_ptr<active_backend> loaded = m_load(name, model);
+            if (!loaded)
+            {
+                fprintf(stderr, "%s: error: unable to load model %s\n", __func__, name.c_str());
+                finish_loading(e, nullptr);
+                return nullptr;
+            }
+            set_loaded(e, loaded);
+            backend = finish_loading(e, std::move(loaded));
+        }
+    }
+
+    touch(e);
+    return backend;
+}
+
+std::shared_ptr<active_backend> model_registry::replace(const std::string &name, const model_files &files, std::shared_ptr<active_backend> backend)
+{
+    entry *e = find(name);
+    if (!e)
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> load_lock(e->load_mtx);
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        set_files(e, files);
+    }
+    set_loaded(e, backend);
+    make_room_for(e);
+    std::shared_ptr<active_backend> old = e->slot.replace(std::move(backend));
+    finish_loading(e, nullptr);
+    touch(e);
+    return old;
+}
+
+std::vector<std::pair<std::string, std::shared_ptr<active_backend>>> model_registry::resident() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    std::vector<std::pair<std::string, std::shared_ptr<active_backend>>> backends;
+    for (auto &e : m_entries)
+    {
+        if (std::shared_ptr<active_backend> backend = e->slot.current())
+        {
+            backends.emplace_back(e->name, backend);
+        }
+    }
+    return backends;
+}
+
+std::string model_registry::status_json() const
+{
+    std::lock_guard<std::mutex> lock(m_mtx);
+    const int64_t now_us = ggml_time_us();
+    std::string json = "[";
+    for (size_t i = 0; i < m_entries.size(); i++)
+    {
+        const entry &e = *m_entries[i];
+        const bool resident = e.slot.current() != nullptr;
+        char buf[128];
+        snprintf(buf, sizeof(buf), "\", \"resident\": %s, \"estimated_bytes\": %lld, \"idle_s\": %.1f}",
+            resident ? "true" : "false", (long long) ((e.model_bytes + e.mmproj_bytes) * m_copies_per_model + e.context_bytes),
+            e.last_used_us == 0 ? -1.0 : (now_us - e.last_used_us) / 1e6);
+        json += std::string(i == 0 ? "" : ", ") + "{\"name\": \"" + escape_json(e.name) + buf;
+    }
+    json += "]";
+    return json;
+}
@@ -0,0 +1,100 @@
+/*
+ * model_registry.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Registry of named models that requests are routed to. A model is a GGUF file and an mmproj file.
+ * Models are loaded on first use and kept resident while they fit in the memory budget; when a
+ * model needs to be loaded and does not fit, the least recently used resident models are evicted.
+ * Evicted models finish the requests they are processing and are freed before the new model is
+ * loaded.
+ */
+
+#pragma once
+#ifndef INCLUDED_MODEL_REGISTRY_HPP
+#define INCLUDED_MODEL_REGISTRY_HPP
+
+#include "backend_slot.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+struct model_files
+{
+    std::string model_path;
+    std::string mmproj_path;
+};
+
+class model_registry
+{
+public:
+    typedef std::function<std::shared_ptr<active_backend>(const std::string &name, const model_files &files)> loader;
+
+    // A budget of 0 keeps every model that has been loaded resident. Each loaded model holds
+    // copies_per_model copies of its files (e.g., one per NUMA replica).
+    model_registry(loader load, int64_t budget_bytes, int copies_per_model = 1);
+
+    // Models must all be added before requests are served
+    void add(const std::string &name, const model_files &files);
+    bool contains(const std::string &name) const;
+
+    // Looks up the files currently registered for a model
+    bool files(const std::string &name, model_files &files) const;
+
+    // Returns the backend for a model, loading it first if it is not resident. Returns nullptr if
+    // the model is unknown or fails to load.
+    std::shared_ptr<active_backend> acquire(const std::string &name);
+
+    // Makes an already loaded backend for the given files resident under a model name (e.g., after
+    // a hot reload), evicting other models if needed. Returns the backend it replaces, if any, to
+    // be passed to backend_slot::free_when_released().
+    std::shared_ptr<active_backend> replace(const std::string &name, const model_files &files, std::shared_ptr<active_backend> backend);
+
+    // Backends of the models that are currently resident, by model name
+    std::vector<std::pair<std::string, std::shared_ptr<active_backend>>> resident() const;
+
+    // JSON array describing each model (by name only) and whether it is resident
+    std::string status_json() const;
+
+private:
+    struct entry
+    {
+        std::string name;
+        model_files files;
+        int64_t model_bytes = 0;        // file sizes, used to estimate resident memory
+        int64_t mmproj_bytes = 0;
+        int64_t context_bytes = 0;      // KV cache and buffers, once the model has been loaded
+        int64_t last_used_us = 0;
+        bool loading = false;           // room has been made for a load that has not finished
+        backend_slot slot;
+        std::mutex load_mtx;            // serializes on-demand loads of this model
+    };
+
+    entry *find(const std::string &name) const;
+    static void set_files(entry *e, const model_files &files);
+    void touch(entry *e);
+    int64_t resident_bytes_with(const entry *e) const;
+    // Evicts models until e fits, waiting for other loads to finish if they are what keeps it from
+    // fitting, and reserves e's memory until finish_loading()
+    void make_room_for(entry *e);
+    // Makes a loaded backend resident (if not nullptr) and releases the reservation. Returns a lease
+    // on the backend, taken before another load can evict it.
+    std::shared_ptr<active_backend> finish_loading(entry *e, std::shared_ptr<active_backend> backend);
+    void set_loaded(entry *e, const std::shared_ptr<active_backend> &backend);
+
+    loader m_load;
+    int64_t m_budget_bytes;
+    int m_copies_per_model;
+    int64_t m_context_estimate = 0;     // largest context_bytes seen, for models not loaded yet
+    int64_t m_freeing_bytes = 0;        // evicted models that requests are still finishing on
+    mutable std::mutex m_mtx;           // guards LRU state and file paths
+    std::condition_variable m_loaded_cv;    // signaled when a load finishes
+    std::vector<std::unique_ptr<entry>> m_entries;
+};
+
+#endif  // INCLUDED_MODEL_REGISTRY_HPP
@@ -0,0 +1,98 @@
+/*
+ * numa.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * NUMA support without a libnuma dependency: the topology is read from sysfs and the memory
+ * policy is set with the set_mempolicy system call.
+ */
+
+#include "numa.hpp"
+#include "stage_threads.hpp"
+
+#ifdef __linux__
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+
+#ifdef __linux__
+static constexpr int k_mpol_default = 0;
+static constexpr int k_mpol_preferred = 1;
+#endif
+
+static bool read_list(const std::string &path, std::vector<int> &values)
+{
+    std::ifstream file(path);
+    std::string line;
+    return std::getline(file, line) && !line.empty() && parse_cpu_list(line, values);
+}
+
+// Removes the CPUs that the calling thread may not run on. Its affinity mask reflects the cgroup
+// cpuset, and at startup it is the mask of the whole process.
+static void restrict_to_affinity(std::vector<int> &cpus)
+{
+#ifdef __linux__
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        return;
+    }
+    cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [&set](int cpu) { return cpu < 0 || cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &set); }), cpus.end());
+#else
+    (void) cpus;
+#endif
+}
+
+std::vector<numa_node> numa_nodes()
+{
+    std::vector<numa_node> nodes;
+    std::vector<int> ids;
+    if (!read_list("/sys/devices/system/node/online", ids))
+    {
+        return nodes;
+    }
+    for (int id : ids)
+    {
+        numa_node node;
+        node.id = id;
+        if (!read_list("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist", node.cpus))
+        {
+            continue;
+        }
+        restrict_to_affinity(node.cpus);
+        if (!node.cpus.empty())
+        {
+            node.n_threads = int(node.cpus.size());
+            nodes.emplace_back(node);
+        }
+    }
+    return nodes;
+}
+
+numa_memory_scope::numa_memory_scope(int node)
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    if (node < 0 || node >= int(8 * sizeof(unsigned long)))
+    {
+        return;
+    }
+    unsigned long mask = 1ul << node;
+    m_set = syscall(SYS_set_mempolicy, k_mpol_preferred, &mask, 8 * sizeof(mask) + 1) == 0;
+#else
+    (void) node;
+#endif
+}
+
+numa_memory_scope::~numa_memory_scope()
+{
+#if defined(__linux__) && defined(SYS_set_mempolicy)
+    if (m_set)
+    {
+        syscall(SYS_set_mempolicy, k_mpol_default, nullptr, 0);
+    }
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ * numa.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * NUMA topology and node-local memory placement, used to run one model replica per node.
+ */
+
+#pragma once
+#ifndef INCLUDED_NUMA_HPP
+#define INCLUDED_NUMA_HPP
+
+#include <vector>
+
+struct numa_node
+{
+    int id;
+    std::vector<int> cpus;      // CPUs of the node that the process may run on
+    int n_threads = 0;          // threads to run on the node, at most one per CPU
+};
+
+// Online NUMA nodes that have CPUs the process may run on (per its affinity mask, which reflects
+// the cgroup cpuset). Must be called before the calling thread is pinned. Empty if the topology
+// cannot be read (e.g., not Linux).
+std::vector<numa_node> numa_nodes();
+
+// While in scope, memory first touched by the calling thread, and by threads it creates, is
+// preferably allocated on the given node. Does nothing on platforms other than Linux.
+class numa_memory_scope
+{
+public:
+    numa_memory_scope(int node);
+    ~numa_memory_scope();
+
+private:
+    bool m_set = false;
+};
+
+#endif  // INCLUDED_NUMA_HPP
@@ -0,0 +1,115 @@
+/*
+ * replica_backend.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Replicated inference backend. A request counts against its replica from the time it is
+ * prepared until its prepared input is destroyed, which covers both the time it spends queued for
+ * the replica and the time the replica spends on it.
+ *
+ * Work for a replica runs pinned to its node's CPUs, which also bounds the stage CPU sets applied
+ * by the backend to that node.
+ */
+
+#include "replica_backend.hpp"
+#include "stage_threads.hpp"
+
+struct replica_backend::replica_input : public prepared_input
+{
+    replica *assigned_to = nullptr;
+    std::unique_ptr<prepared_input> input;
+
+    ~replica_input() override
+    {
+        assigned_to->assigned--;
+    }
+};
+
+replica_backend::replica_backend(std::vector<std::unique_ptr<inference_backend>> backends, const std::vector<std::vector<int>> &cpus)
+{
+    for (size_t i = 0; i < backends.size(); i++)
+    {
+        auto r = std::make_unique<replica>();
+        r->backend = std::move(backends[i]);
+        r->cpus = i < cpus.size() ? cpus[i] : std::vector<int>();
+        m_replicas.emplace_back(std::move(r));
+    }
+}
+
+bool replica_backend::concurrent() const
+{
+    return true;
+}
+
+std::unique_ptr<prepared_input> replica_backend::prepare(
+    const llava_request &request,
+    httplib::Response &web_response,
+    inference_timings &timings
+)
+{
+    replica *least_loaded = m_replicas[0].get();
+    for (auto &r : m_replicas)
+    {
+        if (r->assigned < least_loaded->assigned)
+        {
+            least_loaded = r.get();
+        }
+    }
+
+    auto input = std::make_unique<replica_input>();
+    input->assigned_to = least_loaded;
+    least_loaded->assigned++;
+
+    // Preprocess on the replica's node, so that the image is in its memory
+    stage_affinity affinity(least_loaded->cpus);
+    input->input = least_loaded->backend->prepare(request, web_response, timings);
+    if (!input->input)
+    {
+        return nullptr;
+    }
+    return input;
+}
+
+void replica_backend::perform_inference(
+    const llava_request &request,
+    prepared_input &input,
+    httplib::Response &web_response,
+    int64_t t_hand_off_us,
+    inference_timings &timings
+)
+{
+    replica_input &assigned = static_cast<replica_input &>(input);
+    replica *r = assigned.assigned_to;
+
+    std::lock_guard<std::mutex> lock(r->mtx);
+    if (drain_deadline_passed(web_response))
+    {
+        return;
+    }
+    stage_affinity affinity(r->cpus);
+    r->backend->perform_inference(request, *assigned.input, web_response, t_hand_off_us, timings);
+}
+
+bool replica_backend::save_snapshot(const std::string &path_prefix)
+{
+    std::lock_guard<std::mutex> lock(m_replicas[0]->mtx);
+    return m_replicas[0]->backend->save_snapshot(path_prefix);
+}
+
+void replica_backend::load_snapshot(const std::string &path_prefix)
+{
+    for (auto &r : m_replicas)
+    {
+        std::lock_guard<std::mutex> lock(r->mtx);
+        r->backend->load_snapshot(path_prefix);
+    }
+}
+
+int64_t replica_backend::context_bytes() const
+{
+    int64_t bytes = 0;
+    for (auto &r : m_replicas)
+    {
+        bytes += r->backend->context_bytes();
+    }
+    return bytes;
+}
@@ -0,0 +1,67 @@
+/*
+ * replica_backend.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Inference backend made of several replicas of the same model, each pinned to its own set of
+ * CPUs (one per NUMA node). Requests go to the replica with the fewest requests assigned to it,
+ * and replicas process requests concurrently.
+ */
+
+#pragma once
+#ifndef INCLUDED_REPLICA_BACKEND_HPP
+#define INCLUDED_REPLICA_BACKEND_HPP
+
+#include "inference_backend.hpp"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class replica_backend : public inference_backend
+{
+public:
+    // Takes ownership of the backends. cpus[i] is the CPU set replica i runs on.
+    replica_backend(std::vector<std::unique_ptr<inference_backend>> backends, const std::vector<std::vector<int>> &cpus);
+
+    bool concurrent() const override;
+
+    // Assigns the request to the least loaded replica and prepares it there
+    std::unique_ptr<prepared_input> prepare(
+        const llava_request &request,
+        httplib::Response &web_response,
+        inference_timings &timings
+    ) override;
+
+    void perform_inference(
+        const llava_request &request,
+        prepared_input &input,
+        httplib::Response &web_response,
+        int64_t t_hand_off_us,
+        inference_timings &timings
+    ) override;
+
+    // Only the first replica's caches are saved. The system prompt KV is the same in all replicas
+    // and is restored into each of them. Replicas share one embedding cache (they use the same
+    // mmproj), so the first replica saves the embeddings of all of them and they are restored once.
+    bool save_snapshot(const std::string &path_prefix) override;
+    void load_snapshot(const std::string &path_prefix) override;
+
+    // Summed over the replicas
+    int64_t context_bytes() const override;
+
+private:
+    struct replica
+    {
+        std::unique_ptr<inference_backend> backend;
+        std::vector<int> cpus;
+        std::mutex mtx;                 // serializes inference on this replica
+        std::atomic<int> assigned{0};   // requests prepared for this replica and not yet done
+    };
+
+    struct replica_input;
+
+    std::vector<std::unique_ptr<replica>> m_replicas;
+};
+
+#endif  // INCLUDED_REPLICA_BACKEND_HPP
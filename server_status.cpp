@@ -0,0 +1,128 @@
+/*
+ * server_status.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Readiness and load information. Service time is tracked as an exponentially weighted moving
+ * average. Generated tokens are counted in a ring of per-second buckets covering the last minute;
+ * a bucket is recycled when it is first written in a new second.
+ */
+
+#include "server_status.hpp"
+#include "metrics.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+
+static constexpr int k_window_seconds = 60;
+static constexpr double k_ewma_weight = 0.2;
+
+struct token_bucket
+{
+    std::atomic<int64_t> second;
+    std::atomic<uint64_t> count;
+};
+
+static std::atomic<bool> s_ready(false);
+static std::atomic<int64_t> s_drain_deadline_us(0);      // 0 when not draining
+static std::atomic<int> s_num_slots(1);
+static std::atomic<int64_t> s_service_ewma_us(0);
+static token_bucket s_token_buckets[k_window_seconds];
+
+static int64_t now_seconds()
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static int64_t now_us()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void server_status_set_ready(bool ready)
+{
+    s_ready = ready;
+}
+
+bool server_status_is_ready()
+{
+    return s_ready;
+}
+
+void server_status_begin_drain(int64_t timeout_us)
+{
+    s_ready = false;
+    s_drain_deadline_us = now_us() + timeout_us;
+}
+
+bool server_status_is_draining()
+{
+    return s_drain_deadline_us != 0;
+}
+
+bool server_status_drain_expired()
+{
+    const int64_t deadline_us = s_drain_deadline_us;
+    return deadline_us != 0 && now_us() >= deadline_us;
+}
+
+void server_status_set_slots(int num_slots)
+{
+    s_num_slots = num_slots > 0 ? num_slots : 1;
+}
+
+void server_status_record_service_time(int64_t service_us)
+{
+    int64_t current = s_service_ewma_us.load(std::memory_order_relaxed);
+    int64_t updated;
+    do
+    {
+        updated = current == 0 ? service_us : int64_t(k_ewma_weight * service_us + (1.0 - k_ewma_weight) * current);
+    } while (!s_service_ewma_us.compare_exchange_weak(current, updated, std::memory_order_relaxed));
+}
+
+void server_status_record_tokens(uint64_t num_tokens)
+{
+    const int64_t second = now_seconds();
+    token_bucket &bucket = s_token_buckets[second % k_window_seconds];
+    int64_t bucket_second = bucket.second.load(std::memory_order_relaxed);
+    if (bucket_second != second && bucket.second.compare_exchange_strong(bucket_second, second, std::memory_order_relaxed))
+    {
+        // We won the race to recycle this bucket. Tokens recorded concurrently by a thread that
+        // lost the race may be dropped, which is acceptable for a load estimate.
+        bucket.count.store(num_tokens, std::memory_order_relaxed);
+        return;
+    }
+    bucket.count.fetch_add(num_tokens, std::memory_order_relaxed);
+}
+
+std::string server_status_load_json()
+{
+    const int64_t second = now_seconds();
+    uint64_t tokens = 0;
+    for (token_bucket &bucket : s_token_buckets)
+    {
+        int64_t bucket_second = bucket.second.load(std::memory_order_relaxed);
+        if (bucket_second > second - k_window_seconds && bucket_second <= second)
+        {
+            tokens += bucket.count.load(std::memory_order_relaxed);
+        }
+    }
+
+    const int64_t queue_depth = metrics_gauge_value(metric_gauge::queue_depth);
+    const int64_t active_slots = metrics_gauge_value(metric_gauge::active_slots);
+    const int num_slots = s_num_slots;
+    const double service_ms = s_service_ewma_us.load(std::memory_order_relaxed) / 1000.0;
+
+    // A new request waits for everything queued ahead of it plus, on average, half of what is
+    // currently in progress
+    const double estimated_wait_ms = (queue_depth + 0.5 * active_slots) * service_ms / num_slots;
+
+    char buf[512];
+    snprintf(buf, sizeof(buf),
+        "{\"ready\": %s, \"queue_depth\": %lld, \"active_slots\": %lld, \"total_slots\": %d, "
+        "\"service_time_ms\": %.3f, \"estimated_wait_ms\": %.3f, \"tokens_per_second\": %.3f}",
+        s_ready ? "true" : "false", (long long) queue_depth, (long long) active_slots, num_slots,
+        service_ms, estimated_wait_ms, double(tokens) / k_window_seconds);
+    return buf;
+}
@@ -0,0 +1,36 @@
+/*
+ * server_status.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Readiness and load information for load balancers (/health, /ready, and /load endpoints). All
+ * state is kept in atomics so it can be read without touching the inference path.
+ */
+
+#pragma once
+#ifndef INCLUDED_SERVER_STATUS_HPP
+#define INCLUDED_SERVER_STATUS_HPP
+
+#include <cstdint>
+#include <string>
+
+void server_status_set_ready(bool ready);
+bool server_status_is_ready();
+
+// Graceful shutdown: the server stops reporting ready, and requests still being processed once
+// timeout_us has elapsed are cut short
+void server_status_begin_drain(int64_t timeout_us);
+bool server_status_is_draining();
+bool server_status_drain_expired();
+
+// Number of requests that can be processed concurrently (used to estimate wait times)
+void server_status_set_slots(int num_slots);
+
+// Records service time (hand-off to response, excluding queue wait) of a completed request
+void server_status_record_service_time(int64_t service_us);
+
+void server_status_record_tokens(uint64_t num_tokens);
+
+// JSON object: queue depth, active slots, estimated wait, and tokens/s over the last minute
+std::string server_status_load_json();
+
+#endif  // INCLUDED_SERVER_STATUS_HPP
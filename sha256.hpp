@@ -0,0 +1,40 @@
+/*
+ * sha256.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * SHA-256 (FIPS 180-4), for keys that clients may try to collide, such as those of cached image
+ * embeddings.
+ */
+
+#pragma once
+#ifndef INCLUDED_SHA256_HPP
+#define INCLUDED_SHA256_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+typedef std::array<uint8_t, 32> sha256_digest;
+
+class sha256
+{
+public:
+    sha256();
+
+    void update(const uint8_t *data, size_t size);
+    sha256_digest finish();
+
+    static sha256_digest digest(const uint8_t *data, size_t size);
+    static std::string hex(const sha256_digest &digest);
+
+private:
+    void transform(const uint8_t *block);
+
+    uint32_t m_state[8];
+    uint8_t m_block[64];
+    size_t m_block_size = 0;
+    uint64_t m_total_bytes = 0;
+};
+
+#endif  // INCLUDED_SHA256_HPP
@@ -0,0 +1,170 @@
+/*
+ * slow_log.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Slow-request log. Timeline events are plain structs appended to a thread-local vector whose
+ * capacity is retained across requests, so recording costs no allocation or formatting in the
+ * common case. Formatting only happens for requests over the threshold.
+ */
+
+#include "slow_log.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <vector>
+
+struct slow_event
+{
+    const char *name;       // stage name, or nullptr for a decode step
+    const char *kind;       // decode steps only
+    int n_tokens;
+    int n_past;
+    int64_t start_us;
+    int64_t duration_us;
+};
+
+struct slow_timeline
+{
+    int64_t t_hand_off_us = 0;
+    int image_width = -1;
+    int image_height = -1;
+    const char *cache_status = "none";
+    std::vector<slow_event> events;
+};
+
+static std::atomic<bool> s_enabled(false);
+static int64_t s_threshold_us = 0;
+static std::mutex s_file_mutex;
+static FILE *s_fp = nullptr;
+
+static thread_local slow_timeline t_timeline;
+
+bool slow_log_open(const std::string &filename, int64_t threshold_us)
+{
+    s_fp = fopen(filename.c_str(), "a");
+    if (!s_fp)
+    {
+        fprintf(stderr, "%s: error: unable to open slow request log: %s\n", __func__, filename.c_str());
+        return false;
+    }
+    s_threshold_us = threshold_us;
+    s_enabled = true;
+    return true;
+}
+
+void slow_log_close()
+{
+    std::lock_guard<std::mutex> lock(s_file_mutex);
+    s_enabled = false;
+    if (s_fp)
+    {
+        fclose(s_fp);
+        s_fp = nullptr;
+    }
+}
+
+bool slow_log_enabled()
+{
+    return s_enabled.load(std::memory_order_relaxed);
+}
+
+void slow_log_begin(int64_t t_hand_off_us)
+{
+    if (!slow_log_enabled())
+    {
+        return;
+    }
+    t_timeline.t_hand_off_us = t_hand_off_us;
+    t_timeline.image_width = -1;
+    t_timeline.image_height = -1;
+    t_timeline.cache_status = "none";
+    t_timeline.events.clear();
+    t_timeline.events.reserve(1024);
+}
+
+void slow_log_stage(const char *name, int64_t start_us, int64_t duration_us)
+{
+    if (slow_log_enabled())
+    {
+        t_timeline.events.push_back({ name, nullptr, 0, 0, start_us, duration_us });
+    }
+}
+
+void slow_log_decode(const char *kind, int n_tokens, int n_past, int64_t start_us, int64_t duration_us)
+{
+    if (slow_log_enabled())
+    {
+        t_timeline.events.push_back({ nullptr, kind, n_tokens, n_past, start_us, duration_us });
+    }
+}
+
+void slow_log_set_image(int width, int height)
+{
+    t_timeline.image_width = width;
+    t_timeline.image_height = height;
+}
+
+void slow_log_set_cache_status(const char *status)
+{
+    t_timeline.cache_status = status;
+}
+
+static std::string format_timeline(const llava_request &request, const inference_timings &timings, int64_t total_us, bool error)
+{
+    char buf[512];
+
+    char time_str[32];
+    time_t now = time(nullptr);
+    struct tm tm_utc;
+    gmtime_r(&now, &tm_utc);
+    strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%SZ", &tm_utc);
+
+    snprintf(buf, sizeof(buf),
+        "{\"time\": \"%s\", \"total_ms\": %.3f, \"error\": %s, \"image\": {\"bytes\": %zu, \"width\": %d, \"height\": %d}, "
+        "\"embd_cache\": \"%s\", \"system_prompt_chars\": %zu, \"user_prompt_chars\": %zu, \"timings\": ",
+        time_str, total_us / 1000.0, error ? "true" : "false", request.image_buffer_size, t_timeline.image_width,
+        t_timeline.image_height, t_timeline.cache_status, request.system_prompt.size(), request.user_prompt.size());
+    std::string line(buf);
+    line += timings_to_json(timings);
+
+    // Stages and decode steps, with start times relative to hand-off
+    line += ", \"timeline\": [";
+    for (size_t i = 0; i < t_timeline.events.size(); i++)
+    {
+        const slow_event &event = t_timeline.events[i];
+        const double start_ms = (event.start_us - t_timeline.t_hand_off_us) / 1000.0;
+        const double duration_ms = event.duration_us / 1000.0;
+        if (event.name)
+        {
+            snprintf(buf, sizeof(buf), "%s{\"stage\": \"%s\", \"start_ms\": %.3f, \"dur_ms\": %.3f}",
+                i == 0 ? "" : ", ", event.name, start_ms, duration_ms);
+        }
+        else
+        {
+            snprintf(buf, sizeof(buf), "%s{\"decode\": \"%s\", \"n_tokens\": %d, \"n_past\": %d, \"start_ms\": %.3f, \"dur_ms\": %.3f}",
+                i == 0 ? "" : ", ", event.kind, event.n_tokens, event.n_past, start_ms, duration_ms);
+        }
+        line += buf;
+    }
+    line += "]}\n";
+    return line;
+}
+
+void slow_log_end(const llava_request &request, const inference_timings &timings, int64_t total_us, bool error)
+{
+    if (!slow_log_enabled() || total_us < s_threshold_us)
+    {
+        return;
+    }
+
+    std::string line = format_timeline(request, timings, total_us, error);
+
+    std::lock_guard<std::mutex> lock(s_file_mutex);
+    if (s_fp)
+    {
+        fputs(line.c_str(), s_fp);
+        fflush(s_fp);
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * slow_log.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Slow-request log. While a request is processed, its stages and each llama_decode batch are
+ * recorded into a per-thread timeline. If the request turns out to exceed the latency threshold,
+ * the timeline is written out as one JSON line; otherwise it is discarded without being
+ * formatted.
+ */
+
+#pragma once
+#ifndef INCLUDED_SLOW_LOG_HPP
+#define INCLUDED_SLOW_LOG_HPP
+
+#include "llava_request.hpp"
+#include "inference_timings.hpp"
+
+#include <cstdint>
+#include <string>
+
+bool slow_log_open(const std::string &filename, int64_t threshold_us);
+// Safe to call more than once and from several threads
+void slow_log_close();
+bool slow_log_enabled();
+
+// Starts a new timeline on this thread for a request handed off at t_hand_off_us
+void slow_log_begin(int64_t t_hand_off_us);
+
+// Records a request stage. Name must be a string literal.
+void slow_log_stage(const char *name, int64_t start_us, int64_t duration_us);
+
+// Records a llama_decode call and its batch composition. Kind must be a string literal.
+void slow_log_decode(const char *kind, int n_tokens, int n_past, int64_t start_us, int64_t duration_us);
+
+void slow_log_set_image(int width, int height);
+
+// Image embedding cache status for this request, e.g. "hit" or "miss". String literal.
+void slow_log_set_cache_status(const char *status);
+
+// Ends the timeline, writing it out if total_us exceeds the threshold
+void slow_log_end(const llava_request &request, const inference_timings &timings, int64_t total_us, bool error);
+
+#endif  // INCLUDED_SLOW_LOG_HPP
@@ -0,0 +1,170 @@
+/*
+ * stage_threads.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Per-stage CPU sets. Affinity is only changed on Linux, via pthread_setaffinity_np().
+ */
+
+#include "stage_threads.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static std::vector<int> s_stage_cpus[size_t(pipeline_stage::num_stages)];
+
+// Explicit CPU set the calling thread is currently bound to, if any
+static thread_local const std::vector<int> *t_bound_cpus = nullptr;
+
+bool parse_cpu_list(const std::string &spec, std::vector<int> &cpus)
+{
+    cpus.clear();
+    for (size_t pos = 0, comma; pos <= spec.size(); pos = comma + 1)
+    {
+        comma = spec.find(',', pos);
+        comma = comma == std::string::npos ? spec.size() : comma;
+        const std::string range = spec.substr(pos, comma - pos);
+
+        int first = 0, last = 0;
+        char trailing;
+        if (sscanf(range.c_str(), "%d-%d%c", &first, &last, &trailing) == 2)
+        {
+            // range
+        }
+        else if (sscanf(range.c_str(), "%d%c", &first, &trailing) == 1)
+        {
+            last = first;
+        }
+        else
+        {
+            fprintf(stderr, "%s: error: invalid CPU list '%s'\n", __func__, spec.c_str());
+            return false;
+        }
+        if (first < 0 || last < first)
+        {
+            fprintf(stderr, "%s: error: invalid CPU range '%s'\n", __func__, range.c_str());
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return true;
+}
+
+void set_stage_cpus(pipeline_stage stage, const std::vector<int> &cpus)
+{
+    s_stage_cpus[size_t(stage)] = cpus;
+}
+
+stage_affinity::stage_affinity(pipeline_stage stage)
+{
+    const std::vector<int> &stage_cpus = s_stage_cpus[size_t(stage)];
+    if (!t_bound_cpus || stage_cpus.empty())
+    {
+        pin(stage_cpus);
+        return;
+    }
+
+    // Already on the bound set; narrow to the stage's CPUs within it, if there are any
+    std::vector<int> cpus;
+    for (int cpu : stage_cpus)
+    {
+        if (std::find(t_bound_cpus->begin(), t_bound_cpus->end(), cpu) != t_bound_cpus->end())
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    pin(cpus);
+}
+
+stage_affinity::stage_affinity(const std::vector<int> &cpus)
+{
+    pin(cpus);
+    if (!cpus.empty())
+    {
+        m_bounds = true;
+        m_previous_bound = t_bound_cpus;
+        t_bound_cpus = &cpus;
+    }
+}
+
+void stage_affinity::pin(const std::vector<int> &cpus)
+{
+#ifdef __linux__
+    if (cpus.empty())
+    {
+        return;
+    }
+
+    cpu_set_t previous;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(previous), &previous) != 0)
+    {
+        return;
+    }
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE)
+        {
+            CPU_SET(cpu, &set);
+        }
+    }
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+    {
+        return;
+    }
+
+    m_previous.resize(sizeof(previous));
+    memcpy(m_previous.data(), &previous, sizeof(previous));
+    m_pinned = true;
+#else
+    (void) cpus;
+#endif
+}
+
+stage_affinity::~stage_affinity()
+{
+    if (m_bounds)
+    {
+        t_bound_cpus = m_previous_bound;
+    }
+#ifdef __linux__
+    if (m_pinned)
+    {
+        cpu_set_t previous;
+        memcpy(&previous, m_previous.data(), sizeof(previous));
+        pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+    }
+#endif
+}
+
+stage_limiter::stage_limiter(int limit)
+    : m_limit(limit)
+{
+}
+
+void stage_limiter::acquire()
+{
+    std::unique_lock<std::mutex> lock(m_mtx);
+    m_cv.wait(lock, [this]() { return m_limit <= 0 || m_active < m_limit; });
+    m_active++;
+}
+
+void stage_limiter::release()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mtx);
+        m_active--;
+    }
+    m_cv.notify_one();
+}
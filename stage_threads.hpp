@@ -0,0 +1,73 @@
+/*
+ * stage_threads.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * CPU sets and concurrency limits for the stages of the request pipeline, so that the HTTP
+ * threads, image preprocessing, CLIP, and the LLM can be kept on separate cores rather than
+ * competing for the same ones.
+ */
+
+#pragma once
+#ifndef INCLUDED_STAGE_THREADS_HPP
+#define INCLUDED_STAGE_THREADS_HPP
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum class pipeline_stage
+{
+    http,
+    preprocess,
+    clip,
+    llm,
+    num_stages
+};
+
+// Parses a CPU list such as "0-3,8,10-11"
+bool parse_cpu_list(const std::string &spec, std::vector<int> &cpus);
+
+// Must be configured before any requests are served. An empty list leaves the stage unpinned.
+void set_stage_cpus(pipeline_stage stage, const std::vector<int> &cpus);
+
+// Pins the calling thread to a stage's CPUs for the lifetime of this object, then restores its
+// previous affinity. Threads created in the meantime (e.g., ggml's compute threads) inherit the
+// stage's CPUs. Does nothing if the stage is unpinned or on platforms other than Linux.
+//
+// An explicit CPU set (e.g., a replica's NUMA node) also bounds stages pinned within its lifetime
+// on the same thread: they are pinned to the intersection of both sets, or left on the explicit
+// set if the two do not intersect, so that stage CPU sets never move work off its node.
+class stage_affinity
+{
+public:
+    stage_affinity(pipeline_stage stage);
+    explicit stage_affinity(const std::vector<int> &cpus);     // pins to and bounds by cpus, which must outlive it
+    ~stage_affinity();
+
+private:
+    void pin(const std::vector<int> &cpus);
+
+    bool m_pinned = false;
+    std::vector<unsigned char> m_previous;  // opaque copy of the previous cpu_set_t
+    bool m_bounds = false;
+    const std::vector<int> *m_previous_bound = nullptr;
+};
+
+// Limits how many threads can be in a stage at once. A limit of 0 is unlimited.
+class stage_limiter
+{
+public:
+    stage_limiter(int limit);
+
+    void acquire();
+    void release();
+
+private:
+    std::mutex m_mtx;
+    std::condition_variable m_cv;
+    int m_limit;
+    int m_active = 0;
+};
+
+#endif  // INCLUDED_STAGE_THREADS_HPP
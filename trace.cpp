@@ -0,0 +1,211 @@
+/*
+ * trace.cpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Chrome trace-event output. Each thread appends raw events to its own buffer (guarded by a
+ * per-thread mutex that is only ever contended by the flusher). A background thread swaps the
+ * buffers out every k_flush_interval, formats them, and appends them to the trace file using the
+ * JSON Array Format, which viewers accept even if the closing bracket is missing (e.g., after a
+ * crash).
+ */
+
+#include "trace.hpp"
+#include "json_escape.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+static constexpr auto k_flush_interval = std::chrono::milliseconds(500);
+
+struct trace_event
+{
+    const char *name;
+    const char *category;
+    int64_t start_us;
+    int64_t duration_us;
+    std::string args;
+};
+
+struct thread_buffer
+{
+    std::mutex mtx;
+    int tid = 0;
+    std::string thread_name;
+    bool thread_name_written = false;
+    std::vector<trace_event> events;
+};
+
+static std::atomic<bool> s_enabled(false);
+static FILE *s_fp = nullptr;
+static bool s_first_event = true;
+
+static std::mutex s_buffers_mutex;
+static std::vector<std::unique_ptr<thread_buffer>> s_buffers;     // buffers outlive their threads
+static std::mutex s_flush_mutex;                                  // serializes writes to s_fp
+static std::thread s_flush_thread;
+static std::mutex s_stop_mutex;
+static std::condition_variable s_stop_cv;
+static bool s_stop = false;
+static std::mutex s_close_mutex;                                  // serializes closing by main and the shutdown watchdog
+
+static thread_buffer *this_thread_buffer()
+{
+    thread_local thread_buffer *buffer = nullptr;
+    if (!buffer)
+    {
+        auto new_buffer = std::make_unique<thread_buffer>();
+        buffer = new_buffer.get();
+        std::lock_guard<std::mutex> lock(s_buffers_mutex);
+        buffer->tid = int(s_buffers.size()) + 1;
+        buffer->thread_name = "thread " + std::to_string(buffer->tid);
+        s_buffers.emplace_back(std::move(new_buffer));
+    }
+    return buffer;
+}
+
+static void write_event(const std::string &json)
+{
+    fprintf(s_fp, "%s%s", s_first_event ? "\n" : ",\n", json.c_str());
+    s_first_event = false;
+}
+
+static void flush_buffers()
+{
+    std::lock_guard<std::mutex> flush_lock(s_flush_mutex);
+    if (!s_fp)
+    {
+        return;
+    }
+
+    std::vector<thread_buffer *> buffers;
+    {
+        std::lock_guard<std::mutex> lock(s_buffers_mutex);
+        for (auto &buffer : s_buffers)
+        {
+            buffers.emplace_back(buffer.get());
+        }
+    }
+
+    // Events are built as strings rather than into a fixed buffer, which would truncate long args
+    // into invalid JSON
+    for (thread_buffer *buffer : buffers)
+    {
+        std::vector<trace_event> events;
+        std::string thread_name;
+        bool write_thread_name;
+        {
+            std::lock_guard<std::mutex> lock(buffer->mtx);
+            events.swap(buffer->events);
+            write_thread_name = !buffer->thread_name_written;
+            buffer->thread_name_written = true;
+            thread_name = buffer->thread_name;
+        }
+
+        const std::string tid = std::to_string(buffer->tid);
+        if (write_thread_name)
+        {
+            write_event("{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " + tid + ", \"args\": {\"name\": \"" + escape_json(thread_name) + "\"}}");
+        }
+
+        for (const trace_event &event : events)
+        {
+            write_event("{\"name\": \"" + escape_json(event.name) + "\", \"cat\": \"" + escape_json(event.category) + "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " + tid +
+                ", \"ts\": " + std::to_string(event.start_us) + ", \"dur\": " + std::to_string(event.duration_us) +
+                ", \"args\": " + (event.args.empty() ? "{}" : event.args) + "}");
+        }
+    }
+
+    fflush(s_fp);
+}
+
+static void flush_thread()
+{
+    std::unique_lock<std::mutex> lock(s_stop_mutex);
+    while (!s_stop)
+    {
+        s_stop_cv.wait_for(lock, k_flush_interval);
+        lock.unlock();
+        flush_buffers();
+        lock.lock();
+    }
+}
+
+bool trace_open(const std::string &filename)
+{
+    s_fp = fopen(filename.c_str(), "w");
+    if (!s_fp)
+    {
+        fprintf(stderr, "%s: error: unable to open trace file %s\n", __func__, filename.c_str());
+        return false;
+    }
+    fprintf(s_fp, "[");
+    s_first_event = true;
+    s_stop = false;
+    s_enabled = true;
+    s_flush_thread = std::thread(flush_thread);
+    return true;
+}
+
+void trace_close()
+{
+    std::lock_guard<std::mutex> close_lock(s_close_mutex);
+    if (!s_enabled)
+    {
+        return;
+    }
+
+    s_enabled = false;
+    {
+        std::lock_guard<std::mutex> lock(s_stop_mutex);
+        s_stop = true;
+    }
+    s_stop_cv.notify_one();
+    s_flush_thread.join();
+
+    flush_buffers();
+    std::lock_guard<std::mutex> lock(s_flush_mutex);
+    fprintf(s_fp, "\n]\n");
+    fclose(s_fp);
+    s_fp = nullptr;
+}
+
+bool trace_enabled()
+{
+    return s_enabled.load(std::memory_order_relaxed);
+}
+
+int64_t trace_now_us()
+{
+    // Same clock as ggml_time_us(), so callers may pass ggml timestamps to trace_span()
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + int64_t(ts.tv_nsec) / 1000;
+}
+
+void trace_set_thread_name(const std::string &name)
+{
+    thread_buffer *buffer = this_thread_buffer();
+    std::lock_guard<std::mutex> lock(buffer->mtx);
+    buffer->thread_name = name;
+    buffer->thread_name_written = false;
+}
+
+void trace_span(const char *name, const char *category, int64_t start_us, int64_t duration_us, const std::string &args)
+{
+    if (!trace_enabled())
+    {
+        return;
+    }
+
+    thread_buffer *buffer = this_thread_buffer();
+    std::lock_guard<std::mutex> lock(buffer->mtx);
+    buffer->events.emplace_back(trace_event { name, category, start_us, duration_us, args });
+}
@@ -0,0 +1,62 @@
+/*
+ * trace.hpp
+ * Bart Trzynadlowski, 2023
+ *
+ * Chrome trace-event output (viewable in chrome://tracing or Perfetto). Spans are recorded on
+ * per-thread tracks and flushed to disk periodically by a background thread. When tracing is not
+ * enabled, recording a span costs a single branch.
+ */
+
+#pragma once
+#ifndef INCLUDED_TRACE_HPP
+#define INCLUDED_TRACE_HPP
+
+#include <cstdint>
+#include <string>
+
+bool trace_open(const std::string &filename);
+// Safe to call more than once and from several threads; later calls wait for the first to finish
+void trace_close();
+bool trace_enabled();
+int64_t trace_now_us();
+void trace_set_thread_name(const std::string &name);
+
+// Records a complete span. Name and category must be string literals (or otherwise outlive the
+// trace). Args, if not empty, must be a JSON object.
+void trace_span(const char *name, const char *category, int64_t start_us, int64_t duration_us, const std::string &args = "");
+
+// Records a span covering its own lifetime
+class trace_scope
+{
+public:
+    trace_scope(const char *name, const char *category)
+        : m_name(name),
+          m_category(category),
+          m_start_us(trace_enabled() ? trace_now_us() : 0)
+    {
+    }
+
+    ~trace_scope()
+    {
+        if (m_start_us != 0)
+        {
+            trace_span(m_name, m_category, m_start_us, trace_now_us() - m_start_us, m_args);
+        }
+    }
+
+    void set_args(std::string args)
+    {
+        if (m_start_us != 0)
+        {
+            m_args = std::move(args);
+        }
+    }
+
+private:
+    const char *m_name;
+    const char *m_category;
+    int64_t m_start_us;
+    std::string m_args;
+};
+
+#endif  // INCLUDED_TRACE_HPP
@@ -10,15 +10,35 @@
  * MIT License
  */
 
+#include "web_server.hpp"
 #include "llava_request.hpp"
+#include "metrics.hpp"
+#include "capture.hpp"
+#include "server_status.hpp"
+#include "memory_accounting.hpp"
+#include "stage_threads.hpp"
 
 #include "cpp-httplib/httplib.h"
 
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <mutex>
+#include <thread>
 using namespace httplib;
 
+static std::mutex s_server_mutex;
+static Server *s_server = nullptr;
+static bool s_stop_requested = false;
+
 const char *html = R"(
 <html>
     <head>
@@ -138,68 +158,230 @@ static std::string log(const Request &req, const Response &res)
     return s;
 }
 
-std::string escape_json(const std::string &s)
+// Form fields other than the ones we interpret, recorded as request params when capturing
+static std::vector<std::pair<std::string, std::string>> extra_form_fields(const Request &req)
 {
-    std::ostringstream o;
-    for (auto c = s.cbegin(); c != s.cend(); c++)
-    {
-        switch (*c)
-        {
-        case '"':
-            o << "\\\"";
-            break;
-        case '\\':
-            o << "\\\\";
-            break;
-        case '\b':
-            o << "\\b";
-            break;
-        case '\f':
-            o << "\\f";
-            break;
-        case '\n':
-            o << "\\n";
-            break;
-        case '\r':
-            o << "\\r";
-            break;
-        case '\t':
-            o << "\\t";
-            break;
-        default:
-            if ('\x00' <= *c && *c <= '\x1f')
-            {
-                o << "\\u"
-                  << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(*c);
-            }
-            else
-            {
-                o << *c;
-            }
+    std::vector<std::pair<std::string, std::string>> fields;
+    for (auto &file : req.files)
+    {
+        if (file.first != "user_prompt" && file.first != "image_file" && file.first != "system_prompt")
+        {
+            fields.emplace_back(file.first, file.second.content);
         }
     }
-    return o.str();
+    return fields;
+}
+
+// Releases an in-flight payload reservation when the request is done
+class inflight_reservation
+{
+public:
+    inflight_reservation(int64_t bytes)
+        : m_bytes(bytes)
+    {
+    }
+
+    ~inflight_reservation()
+    {
+        memory_release(memory_component::inflight_payloads, m_bytes);
+    }
+
+private:
+    int64_t m_bytes;
+};
+
+bool is_error_response(const Response &res)
+{
+    return res.body.compare(0, 14, "{\"error\": true") == 0;
+}
+
+// Server::stop() has no effect on a server that has bound its port but not yet entered its accept
+// loop, so a stop in that window is retried until the server is running or has stopped listening
+static void stop_server(Server &svr, const std::function<bool()> &listening)
+{
+    while (listening() && !svr.is_running())
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    svr.stop();
+}
+
+void stop_web_server()
+{
+    std::unique_lock<std::mutex> lock(s_server_mutex);
+    s_stop_requested = true;
+    while (s_server && !s_server->is_running())
+    {
+        lock.unlock();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        lock.lock();
+    }
+    if (s_server)
+    {
+        s_server->stop();
+    }
+}
+
+// Compares in time that depends only on the lengths, so that response times do not reveal how
+// much of a guessed token is right
+static bool constant_time_equal(const std::string &a, const std::string &b)
+{
+    if (a.size() != b.size())
+    {
+        return false;
+    }
+    unsigned char difference = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        difference |= static_cast<unsigned char>(a[i] ^ b[i]);
+    }
+    return difference == 0;
+}
+
+static bool is_admin_request(const Request &req, const std::string &admin_token)
+{
+    return !admin_token.empty() && constant_time_equal(req.get_header_value("Authorization"), "Bearer " + admin_token);
+}
+
+static void set_reuse_port(Server &svr)
+{
+    svr.set_socket_options([](socket_t sock)
+    {
+        int yes = 1;
+        setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char *>(&yes), sizeof(yes));
+#ifdef SO_REUSEPORT
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char *>(&yes), sizeof(yes));
+#endif
+    });
+}
+
+// Load balancer endpoints. These must never wait on inference.
+static void add_probe_endpoints(Server &svr)
+{
+    svr.Get("/health", [](const Request & /*req*/, Response &res)
+    {
+        res.set_content("{\"status\": \"ok\"}", "application/json");
+    });
+
+    svr.Get("/ready", [](const Request & /*req*/, Response &res)
+    {
+        if (server_status_is_ready())
+        {
+            res.set_content("{\"ready\": true}", "application/json");
+        }
+        else
+        {
+            res.status = 503;
+            res.set_content("{\"ready\": false}", "application/json");
+        }
+    });
+
+    svr.Get("/load", [](const Request & /*req*/, Response &res)
+    {
+        res.set_content(server_status_load_json(), "application/json");
+    });
 }
 
-void run_web_server(const std::string host, int port, bool enable_logging, std::function<void(const llava_request &, Response &)> hand_off_request)
+bool run_web_server(const web_server_options &options, const web_server_handlers &handlers)
 {
     Server svr;
 
+    // Bodies larger than the whole in-flight budget could never be admitted, so don't read them
+    const int64_t inflight_budget = memory_budget(memory_component::inflight_payloads);
+    if (inflight_budget > 0)
+    {
+        svr.set_payload_max_length(size_t(inflight_budget));
+    }
+
+    // HTTP threads are created by the thread pool constructor and inherit its CPU set
+#ifdef CPPHTTPLIB_THREAD_POOL_COUNT
+    const size_t default_threads = CPPHTTPLIB_THREAD_POOL_COUNT;
+#else
+    const size_t default_threads = std::max(8u, std::thread::hardware_concurrency() - 1);
+#endif
+    const size_t n_threads = options.n_threads > 0 ? size_t(options.n_threads) : default_threads;
+    svr.new_task_queue = [n_threads]() -> TaskQueue *
+    {
+        stage_affinity affinity(pipeline_stage::http);
+        return new ThreadPool(n_threads);
+    };
+
+    if (options.reuse_port)
+    {
+        set_reuse_port(svr);
+    }
+
     svr.Get("/", [](const Request & /*req*/, Response &res)
     {
         res.set_content(html, "text/html");
     });
 
-    svr.Post("/llava", [&hand_off_request](const Request &req, Response &res)
+    add_probe_endpoints(svr);
+
+    svr.Get("/metrics", [](const Request & /*req*/, Response &res)
+    {
+        res.set_content(metrics_prometheus_text(), "text/plain; version=0.0.4");
+    });
+
+    svr.Get("/debug/memory", [](const Request & /*req*/, Response &res)
+    {
+        res.set_content(memory_report_json(), "application/json");
+    });
+
+    // Hot reload: loads and warms up a new model/mmproj pair in the background and switches new
+    // requests over to it once it is ready
+    svr.Get("/models", [&handlers](const Request & /*req*/, Response &res)
+    {
+        res.set_content(handlers.list_models(), "application/json");
+    });
+
+    svr.Post("/admin/reload", [&options, &handlers](const Request &req, Response &res)
+    {
+        if (!is_admin_request(req, options.admin_token))
+        {
+            res.status = 403;
+            res.set_content("{\"error\": true, \"description\": \"forbidden\"}", "application/json");
+            return;
+        }
+
+        std::string name = req.has_file("name") ? req.get_file_value("name").content : req.get_param_value("name");
+        std::string model_path = req.has_file("model") ? req.get_file_value("model").content : req.get_param_value("model");
+        std::string mmproj_path = req.has_file("mmproj") ? req.get_file_value("mmproj").content : req.get_param_value("mmproj");
+        if (!handlers.request_reload(name.empty() ? "default" : name, model_path, mmproj_path))
+        {
+            res.status = 409;
+            res.set_content("{\"error\": true, \"description\": \"unable to reload now (unknown model, starting up, or already reloading)\"}", "application/json");
+            return;
+        }
+        res.status = 202;
+        res.set_content("{\"error\": false, \"reloading\": true}", "application/json");
+    });
+
+    svr.Post("/llava", [&handlers](const Request &req, Response &res)
     {
         if (!req.has_file("user_prompt") || !req.has_file("image_file"))
         {
             res.set_content("{\"error\": true, \"description\": \"request is missing one or more required fields\"}", "application/json");
+            metrics_increment(metric_counter::errors);
+            return;
         }
 
         MultipartFormData user_prompt = req.get_file_value("user_prompt");
         MultipartFormData img_data = req.get_file_value("image_file");
         MultipartFormData system_prompt = req.get_file_value("system_prompt");  // optional
+        MultipartFormData model = req.get_file_value("model");                  // optional
+
+        // Admission control: the body and our copy of the image are held until the response is
+        // produced, so refuse the request if that would exceed the in-flight budget
+        const int64_t payload_bytes = int64_t(req.body.size() + img_data.content.size());
+        if (!memory_try_reserve(memory_component::inflight_payloads, payload_bytes))
+        {
+            res.status = 503;
+            res.set_content("{\"error\": true, \"description\": \"server is over its in-flight request memory budget\"}", "application/json");
+            metrics_increment(metric_counter::errors);
+            return;
+        }
+        inflight_reservation reservation(payload_bytes);
 
         // Hand off to inference, which must produce a JSON response
         size_t image_buffer_size = img_data.content.length();
@@ -215,16 +397,90 @@ void run_web_server(const std::string host, int port, bool enable_logging, std::
         {
             request.system_prompt = system_prompt.content;
         }
-        hand_off_request(request, res);
+        if (model.content.size() > 0)
+        {
+            request.model = model.content;
+        }
+
+        if (!capture_sample())
+        {
+            handlers.hand_off_request(request, res);
+            return;
+        }
+
+        auto t_start = std::chrono::steady_clock::now();
+        handlers.hand_off_request(request, res);
+        double e2e_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t_start).count();
+        capture_request(request, extra_form_fields(req), res.status == -1 ? 200 : res.status, is_error_response(res), res.get_header_value("Server-Timing"), e2e_ms);
     });
 
-    if (enable_logging)
+    if (options.enable_logging)
     {
         svr.set_logger([](const Request &req, const Response &res)
         {
             printf("%s", log(req, res).c_str());
         });
     }
-    
-    svr.listen(host, port);
+
+    // The probe endpoints are also served on their own port by a separate pool, so that they keep
+    // responding while every thread of the main pool is blocked on a /llava request. The probe
+    // listener stays up until the main one has drained, reporting not ready meanwhile.
+    Server probe_svr;
+    std::thread probe_thread;
+    std::atomic<bool> probe_listening(false);
+    if (options.probe_port > 0)
+    {
+        probe_svr.new_task_queue = []() -> TaskQueue *
+        {
+            stage_affinity affinity(pipeline_stage::http);
+            return new ThreadPool(2);
+        };
+        if (options.reuse_port)
+        {
+            set_reuse_port(probe_svr);
+        }
+        add_probe_endpoints(probe_svr);
+        if (!probe_svr.bind_to_port(options.host, options.probe_port))
+        {
+            fprintf(stderr, "%s: error: unable to listen on probe port %d\n", __func__, options.probe_port);
+            return false;
+        }
+        probe_listening = true;
+        probe_thread = std::thread([&probe_svr, &probe_listening]()
+        {
+            probe_svr.listen_after_bind();
+            probe_listening = false;
+        });
+    }
+
+    // The server is published for stop_web_server() once its port is bound, and stop_web_server()
+    // waits for it to enter its accept loop before stopping it
+    bool ok = svr.bind_to_port(options.host, options.port);
+    if (!ok)
+    {
+        fprintf(stderr, "%s: error: unable to listen on %s:%d\n", __func__, options.host.c_str(), options.port);
+    }
+    bool stopped = true;
+    if (ok)
+    {
+        std::lock_guard<std::mutex> lock(s_server_mutex);
+        stopped = s_stop_requested;
+        if (!stopped)
+        {
+            s_server = &svr;
+        }
+    }
+    if (!stopped)
+    {
+        svr.listen_after_bind();
+        std::lock_guard<std::mutex> lock(s_server_mutex);
+        s_server = nullptr;
+    }
+
+    if (probe_thread.joinable())
+    {
+        stop_server(probe_svr, [&probe_listening]() { return probe_listening.load(); });
+        probe_thread.join();
+    }
+    return ok;
 }
@@ -9,16 +9,40 @@
 #ifndef INCLUDED_WEB_SERVER_HPP
 #define INCLUDED_WEB_SERVER_HPP
 
+#include "json_escape.hpp"
 #include "llava_request.hpp"
 #include "cpp-httplib/httplib.h"
 #include <string>
 
-std::string escape_json(const std::string &s);
-void run_web_server(
-    const std::string host,
-    int port,
-    bool enable_logging,
-    std::function<void(const llava_request &, httplib::Response &)> hand_off_request
-);
+struct web_server_options
+{
+    std::string host = "localhost";
+    int port = 8080;
+    bool enable_logging = false;
+    std::string admin_token;        // if not empty, enables /admin endpoints for this bearer token
+    bool reuse_port = false;        // SO_REUSEPORT, so that a replacement process can listen on the same port
+    int n_threads = 0;              // size of the HTTP thread pool, or 0 for the cpp-httplib default
+    int probe_port = 0;             // if not 0, /health, /ready, and /load are also served on this port by their own threads
+};
+
+struct web_server_handlers
+{
+    // Processes a /llava request, which must produce a JSON response
+    std::function<void(const llava_request &, httplib::Response &)> hand_off_request;
+
+    // Starts loading new files for a registered model in the background (empty paths keep the
+    // current files). Returns false if a reload cannot be started now.
+    std::function<bool(const std::string &name, const std::string &model_path, const std::string &mmproj_path)> request_reload;
+
+    // JSON array describing the registered models
+    std::function<std::string()> list_models;
+};
+
+bool is_error_response(const httplib::Response &res);
+
+// Serves until stop_web_server() is called, which closes the listening socket. Requests being
+// processed are completed before returning. Returns false if the server could not listen.
+bool run_web_server(const web_server_options &options, const web_server_handlers &handlers);
+void stop_web_server();
 
 #endif  // INCLUDED_WEB_SERVER_HPP
\ No newline at end of file